@@ -3,6 +3,21 @@
 
 #include <memory>
 #include <cstring>
+#include <string_view>
+#include <deque>
+#include <list>
+#include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <chrono>
 
 #include <sys/stat.h>
 #include <filesystem>
@@ -12,20 +27,44 @@
 #include <fmt/printf.h>
 #include <curl/curl.h>
 #include <tmpfile/tmpfile.h>
+#include <zlib.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <fileapi.h>
 #include <synchapi.h>
+#include <io.h>
+#include <fcntl.h>
 #define usleep(ms) Sleep(ms)
 #define sleep(s) usleep(s*1000)
+#define fseeko _fseeki64
+#define ftello _ftelli64
 #else
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #endif
 
 uintmax_t SPLIT_SIZE;
 std::string SPLIT_PREFIX;
+uint8_t SPLIT_FANOUT;
+std::vector<std::string> SPLIT_OUT_DIRS;
+bool SPLIT_OUT_BY_SPACE = false;
+bool MAP_COMPRESS = false;
+uint16_t SHARD_DEPTH = 0;
+unsigned JOIN_THREADS = 0; // 0 uses every core
+bool JOIN_UPDATE = false;
+bool JOIN_DELETE = false;
+bool JOIN_RESUME = false;
+std::string JOIN_SPLITS;
+std::string FILES_FROM;
+std::string FIND_PATH;
+bool LS_SUMMARY = false;
+std::vector<std::string> EXCLUDE_PATTERNS;
+std::vector<std::string> INCLUDE_PATTERNS;
+std::vector<std::string> ONLY_PATTERNS;
 
 #include <fmt/core.h>
 #include <fmt/format.h>
@@ -113,14 +152,269 @@ bool remove_files = false;
 bool verbose_files = false;
 bool next_is_size = false;
 bool next_is_name = false;
+bool next_is_fanout = false;
+bool next_is_out_dirs = false;
+bool next_is_out_policy = false;
+bool next_is_files_from = false;
+bool next_is_exclude = false;
+bool next_is_include = false;
+bool next_is_only = false;
+bool next_is_splits = false;
+bool next_is_map_version = false;
+bool next_is_find = false;
+bool next_is_shard = false;
+bool next_is_threads = false;
 bool next_is_help = true;
 int  next_ret = -1; // zero if -h or --help was explicitly specified
 std::string file;
 std::string out_directory;
 
+// the path of a split file relative to the split map
+//
+// a fanout of zero keeps every split next to the split map
+//
+// [fanout 0] 1234 > [prefix.]split.1234
+// [fanout 1] 1234 > [prefix.]splits/12/split.1234
+// [fanout 2] 1234 > [prefix.]splits/00/12/split.1234
+//
+// each level groups 100 splits, the top level is left unbounded
+//
+std::string split_path(const char * prefix, uint8_t fanout, uint64_t split) {
+    if (fanout == 0) {
+        return fmt::format("{}split.{}", prefix, split);
+    }
+    std::string s = fmt::format("{}splits/", prefix);
+    uint64_t level = split / 100;
+    std::string levels;
+    for (uint8_t i = 0; i < fanout; i++) {
+        levels.insert(0, fmt::format("{:02}/", i + 1 == fanout ? level : level % 100));
+        level /= 100;
+    }
+    return fmt::format("{}{}split.{}", s, levels, split);
+}
+
+// where each split of an archive lives
+//
+// splits are stored next to the split map unless they were striped across
+// several output directories, in which case split_dirs holds the index of
+// the directory each split was written to
+//
+struct SplitLayout {
+    std::string prefix;
+    uint8_t fanout = 0;
+    std::vector<std::string> dirs;
+    std::vector<uint16_t> split_dirs;
+
+    // the location of a split, base is the directory (or URL directory) of the split map
+    //
+    // [local] relative directories are resolved against base, absolute ones are used as-is
+    // [url]   directories are expected under base by their final path component
+    //
+    std::string locate(const std::string& base, uint64_t split, bool url = false) const {
+        std::string name = split_path(prefix.c_str(), fanout, split);
+        if (dirs.empty() || split >= split_dirs.size()) {
+            return base + name;
+        }
+        std::filesystem::path dir = dirs[split_dirs[split]];
+        if (url) {
+            return fmt::format("{}{}/{}", base, dir.filename().string(), name);
+        }
+        if (dir.is_absolute()) {
+            return fmt::format("{}/{}", dir.string(), name);
+        }
+        return fmt::format("{}{}/{}", base, dir.string(), name);
+    }
+};
+
+// writes split data on a background thread so that splits placed on
+// different devices are filled in parallel
+//
+// buffers handed to write() are owned by the writer and freed once written
+//
+struct SplitWriter {
+    static const size_t MAX_QUEUED = 64 * 1024 * 1024;
+
+    struct Job {
+        FILE* f;
+        void* buffer; // nullptr closes f
+        size_t length;
+    };
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    size_t queued = 0;
+    bool stopping = false;
+    bool failed = false;
+
+    void start() {
+        thread = std::thread([this] { run(); });
+    }
+
+    void run() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            bool ok = true;
+            if (job.buffer == nullptr) {
+                ok = fflush(job.f) == 0;
+                ok = fclose(job.f) == 0 && ok;
+            }
+            else {
+                ok = fwrite(job.buffer, 1, job.length, job.f) == job.length;
+                free(job.buffer);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queued -= job.length;
+                if (!ok) failed = true;
+            }
+            cv.notify_all();
+        }
+    }
+
+    void push(const Job& job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // always accept a job when idle so a single large buffer cannot stall us
+        cv.wait(lock, [this, &job] { return queued == 0 || queued + job.length <= MAX_QUEUED; });
+        jobs.push_back(job);
+        queued += job.length;
+        cv.notify_all();
+    }
+
+    void write(FILE* f, void* buffer, size_t length) {
+        push({ f, buffer, length });
+    }
+
+    void close(FILE* f) {
+        push({ f, nullptr, 0 });
+    }
+
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return queued;
+    }
+
+    // waits for all queued jobs, returns false if any of them failed
+    bool stop() {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            thread.join();
+        }
+        return !failed;
+    }
+
+    ~SplitWriter() {
+        stop();
+    }
+};
+
+// split map formats
+//
+// version 1 prefixes every field with a 1-byte type tag, integers are fixed
+// size and strings carry a u64 length and a NUL terminator
+//
+// version 2 starts with the raw magic "SPLITMAP", a varint version and
+// varint flags, with MAP_FLAG_DEFLATE the flags are followed by the size of
+// the rest of the map as a raw u64 and the rest of the map is a zlib stream,
+// offsets within the map refer to the uncompressed bytes, with
+// MAP_FLAG_SHARDED the header ends with a shard table, each shard is a
+// separate map named after this one with a ".N" suffix, the table is a
+// varint count followed by the key path of each shard, the varint first
+// split plus one (0 when it holds no data) and varint counts of its dirs,
+// files and symlinks, version 2 also
+// drops the type tags, stores u32/u64 as LEB128 varints, strings as a varint
+// length followed by the bytes, the mode as a u16, and times as zigzag
+// deltas from a base time stored in the header
+//
+// version 2 paths are front-coded against the previous path of the same
+// section, a varint count of shared leading bytes followed by the remaining
+// bytes as a string, symlink targets are stored once in a string table
+// ahead of the symlinks and referenced by a varint index
+//
+// version 2 maps end with an index that sequential readers never reach
+//
+//   path index   entries sorted by path_less, each a front-coded path, a u8
+//                kind, the varint offset of its record and a varint count of
+//                the entries below it, the front-coding restarts every
+//                MAP_INDEX_RESTART entries
+//   restarts     a varint count followed by varint offsets of each restart
+//   bloom filter a varint size, a u8 hash count and the filter bytes
+//   blocks       with MAP_FLAG_BLOCKS, for each of the dirs, files and
+//                symlinks sections a varint count of blocks followed by the
+//                varint offset and first entry of each block, front-coding
+//                restarts at every block so blocks decode independently
+//   summary      with MAP_FLAG_SUMMARY, statistics of the whole archive, a
+//                varint count of size buckets each with varint files and
+//                bytes, bucket 0 holding empty files and bucket i sizes from
+//                2^(i-1) up to 2^i, then a varint count of top-level entries
+//                each a string name and varint dirs, files, symlinks and
+//                bytes, then a varint count of splits each with varint bytes
+//                and chunks
+//   toc          varint offsets of the dirs, files and symlinks sections, the
+//                path index, the restarts and the bloom filter, followed by
+//                the offset of the blocks with MAP_FLAG_BLOCKS and of the
+//                summary with MAP_FLAG_SUMMARY
+//   trailer      the offset of the toc as a raw u64 and "SPLITTOC"
+//
+static const char MAP_MAGIC_V1[] = "BIN_WRITR_MGK";
+static const char MAP_MAGIC_V2[] = "SPLITMAP";
+static const int MAP_VERSION_MAX = 2;
+static const char MAP_TRAILER[] = "SPLITTOC";
+static const uint64_t MAP_INDEX_RESTART = 16;
+static const uint64_t MAP_FLAG_DEFLATE = 1;
+static const uint64_t MAP_FLAG_SHARDED = 2;
+static const uint64_t MAP_FLAG_BLOCKS = 4;
+static const uint64_t MAP_FLAG_SUMMARY = 8;
+static const uint64_t MAP_BLOCK_ENTRIES = 4096;
+
+int MAP_VERSION = MAP_VERSION_MAX;
+
+inline uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// fields are collected in BLOCK_SIZE blocks, once a map outgrows its first
+// block the blocks are handed to a background SplitWriter so serialization
+// does not wait on the disk
+//
 struct BinWriter {
+    static const size_t BLOCK_SIZE = 1024 * 1024;
+
     FILE* bin = nullptr;
-    const char* name = nullptr;
+    std::string name;
+    uint8_t* block = nullptr;
+    size_t used = 0;
+    uint64_t flushed = 0;
+    bool failed = false;
+    std::unique_ptr<SplitWriter> flusher;
+    int version = MAP_VERSION;
+    bool compress = MAP_COMPRESS;
+    bool sharded = SHARD_DEPTH != 0;
+    bool summary = true;
+    bool deflating = false;
+    z_stream zs = {};
+    uint64_t size_offset = 0;
+    int64_t time_base = 0;
+    std::string last_path;
+    std::unordered_map<std::string, uint64_t> string_ids;
 
     enum TYPES : uint8_t {
         U8, U16, U32, U64, STR
@@ -136,39 +430,184 @@ struct BinWriter {
                 throw std::runtime_error(e);
             }
             fseek(bin, 0, SEEK_SET);
+            block = (uint8_t*)malloc(BLOCK_SIZE);
+            if (block == nullptr) {
+                throw std::bad_alloc();
+            }
+            used = 0;
+            flushed = 0;
+            failed = false;
         }
     }
 
-    void close() {
-        if (bin != nullptr) {
-            fflush(bin);
-            fclose(bin);
-            bin = nullptr;
+    // returns false if any part of the map failed to be written
+    bool close() {
+        if (bin == nullptr) {
+            return true;
+        }
+        uint64_t size = deflating ? tell() - size_offset - 8 : 0;
+        flush_block();
+        if (deflating) {
+            deflate_block(nullptr, 0, Z_FINISH);
+            deflateEnd(&zs);
+        }
+        bool ok = !failed;
+        if (flusher) {
+            ok = flusher->stop() && ok;
+            flusher.reset();
+        }
+        if (deflating) {
+            // the size is only known now, patch it into the header
+            ok = fseeko(bin, (int64_t)size_offset, SEEK_SET) == 0 && ok;
+            ok = fwrite(&size, 1, 8, bin) == 8 && ok;
+            deflating = false;
+        }
+        ok = fflush(bin) == 0 && ok;
+        ok = fclose(bin) == 0 && ok;
+        free(block);
+        block = nullptr;
+        bin = nullptr;
+        return ok;
+    }
+
+    // writes a buffer out, when flushing in the background the buffer is
+    // handed over and replaced with a new one
+    void write_out(uint8_t*& buffer, size_t size) {
+        if (flusher) {
+            flusher->write(bin, buffer, size);
+            buffer = (uint8_t*)malloc(BLOCK_SIZE);
+            if (buffer == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        else if (fwrite(buffer, 1, size, bin) != size) {
+            failed = true;
+        }
+    }
+
+    void deflate_block(uint8_t* buffer, size_t size, int flush) {
+        uint8_t* out = (uint8_t*)malloc(BLOCK_SIZE);
+        if (out == nullptr) {
+            throw std::bad_alloc();
+        }
+        zs.next_in = buffer;
+        zs.avail_in = (uInt)size;
+        int ret;
+        do {
+            zs.next_out = out;
+            zs.avail_out = (uInt)BLOCK_SIZE;
+            ret = deflate(&zs, flush);
+            size_t n = BLOCK_SIZE - zs.avail_out;
+            if (n != 0) {
+                write_out(out, n);
+            }
+        } while (zs.avail_in != 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+        free(out);
+    }
+
+    void flush_block() {
+        if (used == 0) {
+            return;
+        }
+        if (deflating) {
+            deflate_block(block, used, Z_NO_FLUSH);
+        }
+        else {
+            write_out(block, used);
+        }
+        flushed += used;
+        used = 0;
+    }
+
+    void put(const void* value, size_t size) {
+        const uint8_t* p = (const uint8_t*)value;
+        while (size != 0) {
+            if (used == BLOCK_SIZE) {
+                // the map is larger than a block, write the rest in the background
+                if (!flusher) {
+                    flusher.reset(new SplitWriter());
+                    flusher->start();
+                }
+                flush_block();
+            }
+            size_t n = std::min(size, BLOCK_SIZE - used);
+            memcpy(block + used, p, n);
+            used += n;
+            p += n;
+            size -= n;
+        }
+    }
+
+    void write_magic() {
+        if (version == 1) {
+            write_string(MAP_MAGIC_V1);
+            return;
         }
+        put(MAP_MAGIC_V2, 8);
+        write_varint(version);
+        write_varint((compress ? MAP_FLAG_DEFLATE : 0) | (sharded ? MAP_FLAG_SHARDED : 0) | MAP_FLAG_BLOCKS | (summary ? MAP_FLAG_SUMMARY : 0));
+        if (compress) {
+            uint64_t size = 0;
+            size_offset = tell();
+            put(&size, 8);
+            // the header stays uncompressed, everything after it is deflated
+            flush_block();
+            if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+                throw std::runtime_error("failed to initialize zlib");
+            }
+            deflating = true;
+        }
+    }
+
+    void write_varint(uint64_t value) {
+        uint8_t buf[10];
+        size_t n = 0;
+        do {
+            uint8_t b = value & 0x7f;
+            value >>= 7;
+            buf[n++] = value != 0 ? (b | 0x80) : b;
+        } while (value != 0);
+        put(buf, n);
     }
 
     void write_u8(uint8_t value) {
+        if (version >= 2) {
+            put(&value, 1);
+            return;
+        }
         uint8_t t = U8;
-        fwrite(&t, 1, 1, bin);
-        fwrite(&value, 1, 1, bin);
+        put(&t, 1);
+        put(&value, 1);
     }
 
     void write_u16(uint16_t value) {
+        if (version >= 2) {
+            put(&value, 2);
+            return;
+        }
         uint8_t t = U16;
-        fwrite(&t, 1, 1, bin);
-        fwrite(&value, 1, 2, bin);
+        put(&t, 1);
+        put(&value, 2);
     }
 
     void write_u32(uint32_t value) {
+        if (version >= 2) {
+            write_varint(value);
+            return;
+        }
         uint8_t t = U32;
-        fwrite(&t, 1, 1, bin);
-        fwrite(&value, 1, 4, bin);
+        put(&t, 1);
+        put(&value, 4);
     }
 
     void write_u64(uint64_t value) {
+        if (version >= 2) {
+            write_varint(value);
+            return;
+        }
         uint8_t t = U64;
-        fwrite(&t, 1, 1, bin);
-        fwrite(&value, 1, 8, bin);
+        put(&t, 1);
+        put(&value, 8);
     }
 
     void write_string(const char* value) {
@@ -176,139 +615,644 @@ struct BinWriter {
             value = "";
         }
 
+        if (version >= 2) {
+            size_t size = strlen(value);
+            write_varint(size);
+            put(value, size);
+            return;
+        }
         uint64_t size = (strlen(value)+1) * sizeof(char);
         uint8_t t = STR;
-        fwrite(&t, 1, 1, bin);
-        fwrite(&size, 1, 8, bin);
-        fwrite(value, 1, size, bin);
+        put(&t, 1);
+        put(&size, 8);
+        put(value, size);
+    }
+
+    void write_perms(const std::string& perms, uint16_t mode) {
+        if (version >= 2) {
+            write_u16(mode);
+        }
+        else {
+            write_string(perms.c_str());
+        }
+    }
+
+    // version 1 stores no base, times are written in full
+    void write_time_base(int64_t base) {
+        if (version >= 2) {
+            time_base = base;
+            write_varint(zigzag_encode(base));
+        }
+    }
+
+    void write_time(int64_t value) {
+        if (version >= 2) {
+            write_varint(zigzag_encode(value - time_base));
+        }
+        else {
+            write_u64((uint64_t)value);
+        }
+    }
+
+    uint64_t tell() {
+        return flushed + used;
+    }
+
+    void write_raw(const void* value, size_t size) {
+        put(value, size);
+    }
+
+    // starts a new section, the next path is written in full
+    void reset_paths() {
+        last_path.clear();
+    }
+
+    void write_path(const char* value) {
+        if (version < 2) {
+            write_string(value);
+            return;
+        }
+        size_t size = strlen(value);
+        size_t shared = 0;
+        size_t max = std::min(size, last_path.size());
+        while (shared < max && last_path[shared] == value[shared]) {
+            shared++;
+        }
+        write_varint(shared);
+        write_varint(size - shared);
+        put(value + shared, size - shared);
+        last_path.assign(value, size);
+    }
+
+    // version 1 stores no table, strings are written in full where used
+    void write_string_table(const std::vector<std::string>& strings) {
+        if (version < 2) {
+            return;
+        }
+        string_ids.clear();
+        std::vector<const std::string*> table;
+        for (const std::string& value : strings) {
+            if (string_ids.emplace(value, table.size()).second) {
+                table.emplace_back(&value);
+            }
+        }
+        write_varint(table.size());
+        for (const std::string* value : table) {
+            write_string(value->c_str());
+        }
+    }
+
+    void write_string_ref(const std::string& value) {
+        if (version < 2) {
+            write_string(value.c_str());
+            return;
+        }
+        write_varint(string_ids.at(value));
     }
 };
 
+std::string permissions_to_string(uint16_t mode);
+
+// reads a split map through a read-only mapping of the whole file
+//
+// integers are decoded straight from the mapping and strings are returned
+// as views into it, nothing is copied unless a path has to be rebuilt from
+// its front-coded form
+//
+// a deflated map is inflated into a buffer of its full size as the reader
+// moves through it, the buffer never moves so views into it stay valid
+//
 struct BinReader {
-    FILE* bin = nullptr;
+    static const uint64_t INFLATE_AHEAD = 256 * 1024;
+
+    const uint8_t* map = nullptr;
+    uint64_t map_size = 0;
+    const uint8_t* data = nullptr;
+    uint64_t size = 0;
+    uint64_t avail = 0;
+    uint64_t pos = 0;
+    bool is_open = false;
+    uint8_t* inflated = nullptr;
+    uint64_t in_pos = 0;
+    z_stream zs = {};
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+    int version = 1;
+    uint64_t flags = 0;
+    int64_t time_base = 0;
+    std::string path;
+    std::vector<std::string_view> strings;
+    std::unordered_map<uint16_t, std::string> perms;
 
     void open(const char* name) {
-        if (bin == nullptr) {
-            bin = fopen(name, "rb");
-            if (bin == nullptr) {
+        if (is_open) {
+            return;
+        }
+#ifdef _WIN32
+        file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER file_size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size)) {
+            auto se = GetLastError();
+            if (file != INVALID_HANDLE_VALUE) {
+                CloseHandle(file);
+                file = INVALID_HANDLE_VALUE;
+            }
+            std::string e = fmt::format("failed to open item {}\nerror: {}\n", name, se);
+            throw std::runtime_error(e);
+        }
+        size = (uint64_t)file_size.QuadPart;
+        if (size != 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            map = mapping == nullptr ? nullptr : (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            if (map == nullptr) {
+                auto se = GetLastError();
+                if (mapping != nullptr) {
+                    CloseHandle(mapping);
+                    mapping = nullptr;
+                }
+                CloseHandle(file);
+                file = INVALID_HANDLE_VALUE;
+                std::string e = fmt::format("failed to map item {}\nerror: {}\n", name, se);
+                throw std::runtime_error(e);
+            }
+        }
+#else
+        int fd = ::open(name, O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            auto se = errno;
+            if (fd != -1) {
+                ::close(fd);
+            }
+            std::string e = fmt::format("failed to open item {}\nerrno: -{} ({})\n", name, se, fmt::system_error(se, ""));
+            throw std::runtime_error(e);
+        }
+        size = (uint64_t)st.st_size;
+        if (size != 0) {
+            void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
                 auto se = errno;
-                std::string e = fmt::format("failed to open item {}\nerrno: -{} ({})\n", name, se, fmt::system_error(se, ""));
+                ::close(fd);
+                std::string e = fmt::format("failed to map item {}\nerrno: -{} ({})\n", name, se, fmt::system_error(se, ""));
                 throw std::runtime_error(e);
             }
-            fseek(bin, 0, SEEK_SET);
+            madvise(map, size, MADV_SEQUENTIAL);
+            this->map = (const uint8_t*)map;
         }
+        ::close(fd);
+#endif
+        map_size = size;
+        data = this->map;
+        avail = size;
+        pos = 0;
+        is_open = true;
     }
 
     void close() {
-        if (bin != nullptr) {
-            fclose(bin);
-            bin = nullptr;
+        if (!is_open) {
+            return;
+        }
+        if (inflated != nullptr) {
+            inflateEnd(&zs);
+            free(inflated);
+            inflated = nullptr;
+        }
+#ifdef _WIN32
+        if (map != nullptr) {
+            UnmapViewOfFile(map);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+            mapping = nullptr;
+        }
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (map != nullptr) {
+            munmap((void*)map, map_size);
+        }
+#endif
+        map = nullptr;
+        map_size = 0;
+        data = nullptr;
+        size = 0;
+        avail = 0;
+        pos = 0;
+        strings.clear();
+        is_open = false;
+    }
+
+    ~BinReader() {
+        close();
+    }
+
+    // points this reader at the map of another one so that several threads
+    // can decode it at once, the other reader keeps ownership of the map
+    void share(BinReader& other) {
+        other.fill(other.size);
+        data = other.data;
+        size = other.size;
+        avail = other.size;
+        pos = 0;
+        version = other.version;
+        flags = other.flags;
+        time_base = other.time_base;
+        strings = other.strings;
+    }
+
+    // inflates until the first end bytes of the map are available
+    void fill(uint64_t end) {
+        while (avail < end) {
+            if (zs.avail_in == 0 && in_pos < map_size) {
+                zs.next_in = (Bytef*)(map + in_pos);
+                zs.avail_in = (uInt)std::min<uint64_t>(map_size - in_pos, 1 << 30);
+                in_pos += zs.avail_in;
+            }
+            zs.next_out = inflated + avail;
+            zs.avail_out = (uInt)std::min<uint64_t>({ size - avail, std::max<uint64_t>(end - avail, INFLATE_AHEAD), 1 << 30 });
+            uInt before = zs.avail_out;
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                throw std::runtime_error("corrupt split map");
+            }
+            avail += before - zs.avail_out;
+            if (before == zs.avail_out && avail < end) {
+                throw std::runtime_error("unexpected end of split map");
+            }
+        }
+    }
+
+    // returns the next size bytes and moves past them
+    const uint8_t* take(uint64_t n) {
+        if (n > size - pos) {
+            throw std::runtime_error("unexpected end of split map");
+        }
+        if (pos + n > avail) {
+            fill(pos + n);
+        }
+        const uint8_t* p = data + pos;
+        pos += n;
+        return p;
+    }
+
+    template <typename T>
+    T take_value() {
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    void expect_type(uint8_t expected, const char* error) {
+        if (*take(1) != expected) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    // detects the map version, returns false with a description on failure
+    bool read_magic(std::string& error) {
+        flags = 0;
+        if (peek_type() == BinWriter::STR) {
+            version = 1;
+            std::string_view str = read_view();
+            bool ok = str == MAP_MAGIC_V1;
+            if (!ok) {
+                error = fmt::format("invalid magic: {}", str);
+            }
+            return ok;
+        }
+        if (size - pos < 8 || memcmp(data + pos, MAP_MAGIC_V2, 8) != 0) {
+            error = "invalid magic";
+            return false;
+        }
+        pos += 8;
+        uint64_t v = read_varint();
+        if (v < 2 || v > MAP_VERSION_MAX) {
+            error = fmt::format("unsupported split map version: {}", v);
+            return false;
+        }
+        version = (int)v;
+        flags = read_varint();
+        if ((flags & ~(MAP_FLAG_DEFLATE | MAP_FLAG_SHARDED | MAP_FLAG_BLOCKS | MAP_FLAG_SUMMARY)) != 0) {
+            error = fmt::format("unsupported split map flags: {}", flags);
+            return false;
+        }
+        if ((flags & MAP_FLAG_DEFLATE) != 0) {
+            uint64_t body = take_value<uint64_t>();
+            inflated = (uint8_t*)malloc(pos + body);
+            if (inflated == nullptr) {
+                throw std::bad_alloc();
+            }
+            zs = {};
+            if (inflateInit(&zs) != Z_OK) {
+                free(inflated);
+                inflated = nullptr;
+                error = "failed to initialize zlib";
+                return false;
+            }
+            // the header is copied so offsets into the map stay the same
+            memcpy(inflated, data, pos);
+            in_pos = pos;
+            data = inflated;
+            avail = pos;
+            size = pos + body;
+        }
+        return true;
+    }
+
+    uint64_t read_varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t c = *take(1);
+            value |= (uint64_t)(c & 0x7f) << shift;
+            if ((c & 0x80) == 0) {
+                return value;
+            }
         }
+        throw std::runtime_error("varint too long");
     }
 
     uint8_t read_u8() {
-        uint8_t type;
-        fread(&type, 1, 1, bin);
-        if (type != BinWriter::U8) {
-            throw std::runtime_error("type was not U8");
+        if (version < 2) {
+            expect_type(BinWriter::U8, "type was not U8");
         }
-        fread(&type, 1, 1, bin);
-        return type;
+        return *take(1);
     }
 
     uint16_t read_u16() {
-        uint8_t type;
-        fread(&type, 1, 1, bin);
-        if (type != BinWriter::U16) {
-            throw std::runtime_error("type was not U16");
+        if (version < 2) {
+            expect_type(BinWriter::U16, "type was not U16");
         }
-        uint16_t value;
-        fread(&value, 1, 2, bin);
-        return value;
+        return take_value<uint16_t>();
     }
 
     uint32_t read_u32() {
-        uint8_t type;
-        fread(&type, 1, 1, bin);
-        if (type != BinWriter::U32) {
-            throw std::runtime_error("type was not U32");
+        if (version >= 2) {
+            return (uint32_t)read_varint();
         }
-        uint32_t value;
-        fread(&value, 1, 4, bin);
-        return value;
+        expect_type(BinWriter::U32, "type was not U32");
+        return take_value<uint32_t>();
+    }
+
+    // returns the type of the next item without consuming it, or -1 at EOF
+    int peek_type() {
+        return pos < size ? data[pos] : -1;
     }
 
     uint64_t read_u64() {
-        uint8_t type;
-        fread(&type, 1, 1, bin);
-        if (type != BinWriter::U64) {
-            throw std::runtime_error("type was not U64");
+        if (version >= 2) {
+            return read_varint();
         }
-        uint64_t value;
-        fread(&value, 1, 8, bin);
-        return value;
+        expect_type(BinWriter::U64, "type was not U64");
+        return take_value<uint64_t>();
     }
 
+    // returns a string as a view into the mapping, valid until close
+    //
+    // version 1 strings are stored with their NUL terminator, so the data of
+    // the view can also be passed on as a C string
+    //
+    std::string_view read_view() {
+        if (version >= 2) {
+            uint64_t n = read_varint();
+            return std::string_view((const char*)take(n), n);
+        }
+        expect_type(BinWriter::STR, "type was not STR");
+        uint64_t n = take_value<uint64_t>();
+        const char* value = (const char*)take(n);
+        return std::string_view(value, n == 0 ? 0 : strnlen(value, n));
+    }
+
+    // returns a copy of a string, to be freed by the caller
     const char * read_string() {
-        uint8_t type;
-        fread(&type, 1, 1, bin);
-        if (type != BinWriter::STR) {
-            throw std::runtime_error("type was not STR");
-        }
-        uint64_t size;
-        fread(&size, 1, 8, bin);
-        char* value = (char*)malloc(size);
+        std::string_view view = read_view();
+        char* value = (char*)malloc(view.size() + 1);
         if (value == nullptr) {
             throw std::bad_alloc();
         }
-        fread(value, 1, size, bin);
+        memcpy(value, view.data(), view.size());
+        value[view.size()] = '\0';
         return value;
     }
-};
 
-bool get_stats(const std::filesystem::path& path, struct stat& st) {
-    auto ps = std::filesystem::absolute(path).string();
-    auto s = ps.c_str();
-#if HAVE_LSTAT
-    if (lstat(s, &st) == -1) {
-#else
-    if (stat(s, &st) == -1) {
-#endif
-        auto se = errno;
-#if HAVE_LSTAT
-        fmt::print("failed to lstat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
-#else
-        fmt::print("failed to stat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
-#endif
-        return false;
+    // returns a permission string such as drwxr-xr-x, valid until the reader
+    // is destroyed
+    const char * read_perms() {
+        if (version >= 2) {
+            uint16_t mode = read_u16();
+            auto it = perms.find(mode);
+            if (it == perms.end()) {
+                it = perms.emplace(mode, permissions_to_string(mode)).first;
+            }
+            return it->second.c_str();
+        }
+        return read_view().data();
     }
-    return true;
-}
 
-bool path_exists(const std::filesystem::path& path) {
-    struct stat st;
-    auto ps = std::filesystem::absolute(path).string();
-    auto s = ps.c_str();
-#if HAVE_LSTAT
-    if (lstat(s, &st) == -1) {
-#else
-    if (stat(s, &st) == -1) {
-#endif
-        auto se = errno;
-        if (se == ENOENT) return false;
-#if HAVE_LSTAT
-        fmt::print("failed to lstat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
-#else
-        fmt::print("failed to stat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
-#endif
-        return false;
+    void read_time_base() {
+        if (version >= 2) {
+            time_base = zigzag_decode(read_varint());
+        }
     }
-    return true;
-}
 
-inline bool is_directory(const struct stat& st) {
-    return (st.st_mode & S_IFMT) == S_IFDIR;
-}
+    int64_t read_time() {
+        if (version >= 2) {
+            return time_base + zigzag_decode(read_varint());
+        }
+        return (int64_t)read_u64();
+    }
+
+    uint64_t tell() {
+        return pos;
+    }
+
+    // the previous path is kept, callers that seek to the start of a section
+    // or restart point call reset_paths
+    void seek(uint64_t offset) {
+        pos = std::min(offset, size);
+    }
+
+    bool read_raw(void* value, size_t n) {
+        if (n > size - pos) {
+            return false;
+        }
+        if (pos + n > avail) {
+            fill(pos + n);
+        }
+        memcpy(value, data + pos, n);
+        pos += n;
+        return true;
+    }
+
+    void reset_paths() {
+        path.clear();
+    }
+
+    // skips a path without decoding it, used after seeking into a section
+    // where the previous path is unknown
+    void skip_path() {
+        if (version < 2) {
+            read_view();
+            return;
+        }
+        read_varint();
+        take(read_varint());
+    }
+
+    // returns the next path, valid until the next call, callers that keep
+    // the path must copy it
+    //
+    // version 1 paths point straight into the mapping
+    //
+    const char * read_path() {
+        if (version < 2) {
+            return read_view().data();
+        }
+        uint64_t shared = read_varint();
+        uint64_t n = read_varint();
+        if (shared > path.size()) {
+            throw std::runtime_error("path prefix out of range");
+        }
+        path.resize(shared);
+        path.append((const char*)take(n), n);
+        return path.c_str();
+    }
+
+    void read_string_table() {
+        strings.clear();
+        if (version < 2) {
+            return;
+        }
+        uint64_t count = read_varint();
+        strings.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            strings.emplace_back(read_view());
+        }
+    }
+
+    // returns a string from the table, valid until close
+    std::string_view read_string_ref() {
+        if (version < 2) {
+            return read_view();
+        }
+        uint64_t index = read_varint();
+        if (index >= strings.size()) {
+            throw std::runtime_error("string index out of range");
+        }
+        return strings[index];
+    }
+};
+
+// orders paths byte by byte with '/' below every other byte, so a directory
+// is directly followed by everything below it
+bool path_less(const std::string& a, const std::string& b) {
+    size_t size = std::min(a.size(), b.size());
+    for (size_t i = 0; i < size; i++) {
+        uint8_t x = a[i] == '/' ? 0 : (uint8_t)a[i];
+        uint8_t y = b[i] == '/' ? 0 : (uint8_t)b[i];
+        if (x != y) {
+            return x < y;
+        }
+    }
+    return a.size() < b.size();
+}
+
+// a bloom filter over the paths of a split map, using double hashing of a
+// 64 bit FNV-1a hash
+//
+struct PathBloom {
+    static const uint8_t HASHES = 7;
+    static const uint64_t BITS_PER_PATH = 10;
+
+    std::vector<uint8_t> bits;
+    uint8_t hashes = HASHES;
+
+    static void hash(const std::string& path, uint64_t& h1, uint64_t& h2) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (char c : path) {
+            h ^= (uint8_t)c;
+            h *= 0x100000001b3ull;
+        }
+        h1 = h;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h2 = h | 1;
+    }
+
+    void init(uint64_t paths) {
+        bits.assign(std::max<uint64_t>(1, (paths * BITS_PER_PATH + 7) / 8), 0);
+    }
+
+    void add(const std::string& path) {
+        uint64_t h1, h2, m = bits.size() * 8;
+        hash(path, h1, h2);
+        for (uint8_t i = 0; i < hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % m;
+            bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+    }
+
+    bool maybe_contains(const std::string& path) const {
+        if (bits.empty()) {
+            return true;
+        }
+        uint64_t h1, h2, m = bits.size() * 8;
+        hash(path, h1, h2);
+        for (uint8_t i = 0; i < hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % m;
+            if ((bits[bit / 8] & (1 << (bit % 8))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+bool get_stats(const std::filesystem::path& path, struct stat& st) {
+    auto ps = std::filesystem::absolute(path).string();
+    auto s = ps.c_str();
+#if HAVE_LSTAT
+    if (lstat(s, &st) == -1) {
+#else
+    if (stat(s, &st) == -1) {
+#endif
+        auto se = errno;
+#if HAVE_LSTAT
+        fmt::print("failed to lstat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
+#else
+        fmt::print("failed to stat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
+#endif
+        return false;
+    }
+    return true;
+}
+
+bool path_exists(const std::filesystem::path& path) {
+    struct stat st;
+    auto ps = std::filesystem::absolute(path).string();
+    auto s = ps.c_str();
+#if HAVE_LSTAT
+    if (lstat(s, &st) == -1) {
+#else
+    if (stat(s, &st) == -1) {
+#endif
+        auto se = errno;
+        if (se == ENOENT) return false;
+#if HAVE_LSTAT
+        fmt::print("failed to lstat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
+#else
+        fmt::print("failed to stat {}\nerrno: -{} ({})\n", s, se, fmt::system_error(se, ""));
+#endif
+        return false;
+    }
+    return true;
+}
+
+inline bool is_directory(const struct stat& st) {
+    return (st.st_mode & S_IFMT) == S_IFDIR;
+}
 
 inline bool is_reg(const struct stat& st) {
     return (st.st_mode & S_IFMT) == S_IFREG;
@@ -348,8 +1292,14 @@ std::string permissions_to_string(const struct stat& st) {
     return s;
 }
 
+std::string permissions_to_string(uint16_t mode) {
+    struct stat st = {};
+    st.st_mode = mode;
+    return permissions_to_string(st);
+}
+
 struct stat string_to_permissions(const char * s) {
-    struct stat st;
+    struct stat st = {};
 #if HAVE_LSTAT
     st.st_mode |= s[0] == 'd' ? S_IFDIR : s[0] == 'l' ? S_IFLNK : S_IFREG;
 #else
@@ -368,7 +1318,7 @@ struct stat string_to_permissions(const char * s) {
 }
 
 std::filesystem::perms permissions_to_filesystem(const struct stat& st) {
-    std::filesystem::perms s;
+    std::filesystem::perms s = std::filesystem::perms::none;
     s |= (st.st_mode & S_IRUSR) == S_IRUSR ? std::filesystem::perms::owner_read : std::filesystem::perms::none;
     s |= (st.st_mode & S_IWUSR) == S_IWUSR ? std::filesystem::perms::owner_write : std::filesystem::perms::none;
     s |= (st.st_mode & S_IXUSR) == S_IXUSR ? std::filesystem::perms::owner_exec : std::filesystem::perms::none;
@@ -381,6 +1331,288 @@ std::filesystem::perms permissions_to_filesystem(const struct stat& st) {
     return s;
 }
 
+// matches paths relative to the root against a set of exclude and include globs
+//
+// all patterns are compiled into a single NFA which is turned into a DFA lazily,
+// one transition at a time, so the cost of matching a character does not depend
+// on the number of patterns
+//
+// a pattern without a '/' matches a name at any depth, otherwise it is anchored
+// at the root, a trailing '/' only matches directories
+//
+//   *     anything except '/'
+//   **    anything, "**/" matches zero or more directories
+//   ?     any character except '/'
+//   [a-z] a character class, [!a-z] or [^a-z] negates it
+//   \c    the character c
+//
+// a match on a directory also matches everything beneath it, an include
+// match overrides an exclude match
+//
+struct GlobMatcher {
+    enum : uint8_t {
+        EXCLUDE = 1,
+        INCLUDE = 2,
+        EXCLUDE_DIR = 4,
+        INCLUDE_DIR = 8,
+        INCLUDE_ALIVE = 16 // an include pattern may still match
+    };
+
+    struct Node {
+        enum Kind : uint8_t {
+            CHARS,   // one character in chars
+            STAR,    // any characters except '/'
+            ANYPATH, // any characters
+            ANYDIRS, // nothing or anything ending in '/'
+            ACCEPT,  // the end of a pattern
+            SUBTREE  // anything beneath a matched directory
+        } kind;
+        bool include;
+        uint8_t flags;
+        std::bitset<256> chars;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<size_t> starts;
+
+    std::map<std::vector<uint32_t>, int> state_ids;
+    std::vector<std::vector<uint32_t>> states;
+    std::vector<std::array<int, 256>> transitions;
+    std::vector<uint8_t> state_flags;
+
+    bool empty() const {
+        return starts.empty();
+    }
+
+    void add(const std::string& pattern, bool include) {
+        std::string p = pattern;
+        bool dir_only = false;
+        while (p.length() > 1 && p.back() == '/') {
+            p.pop_back();
+            dir_only = true;
+        }
+        while (p.length() > 2 && p[0] == '.' && p[1] == '/') {
+            p.erase(0, 2);
+        }
+        bool anchored = p.find('/') != std::string::npos;
+        if (!p.empty() && p[0] == '/') {
+            p.erase(0, 1);
+        }
+        starts.emplace_back(nodes.size());
+        auto push = [&](Node::Kind kind) -> Node& {
+            nodes.emplace_back();
+            Node& n = nodes.back();
+            n.kind = kind;
+            n.include = include;
+            n.flags = 0;
+            return n;
+        };
+        if (!anchored) {
+            push(Node::ANYDIRS);
+        }
+        for (size_t i = 0; i < p.length(); i++) {
+            char c = p[i];
+            if (c == '*') {
+                size_t stars = 1;
+                while (i + stars < p.length() && p[i + stars] == '*') stars++;
+                bool component = i == 0 || p[i - 1] == '/';
+                i += stars - 1;
+                if (stars == 1) {
+                    push(Node::STAR);
+                }
+                else if (component && i + 1 < p.length() && p[i + 1] == '/') {
+                    push(Node::ANYDIRS);
+                    i++;
+                }
+                else {
+                    push(Node::ANYPATH);
+                }
+            }
+            else if (c == '?') {
+                push(Node::CHARS).chars.set().reset('/');
+            }
+            else if (c == '[' && p.find(']', i + 2) != std::string::npos) {
+                size_t j = i + 1;
+                bool negate = p[j] == '!' || p[j] == '^';
+                if (negate) j++;
+                std::bitset<256> set;
+                // a ']' directly after the opening bracket is a literal
+                do {
+                    uint8_t lo = (uint8_t)p[j];
+                    if (j + 2 < p.length() && p[j + 1] == '-' && p[j + 2] != ']') {
+                        uint8_t hi = (uint8_t)p[j + 2];
+                        for (unsigned k = lo; k <= hi; k++) set.set(k);
+                        j += 3;
+                    }
+                    else {
+                        set.set(lo);
+                        j++;
+                    }
+                } while (j < p.length() && p[j] != ']');
+                if (negate) set.flip();
+                set.reset('/');
+                push(Node::CHARS).chars = set;
+                i = j;
+            }
+            else {
+                if (c == '\\' && i + 1 < p.length()) {
+                    c = p[++i];
+                }
+                push(Node::CHARS).chars.set((uint8_t)c);
+            }
+        }
+        push(Node::ACCEPT).flags = include ? (dir_only ? INCLUDE_DIR : INCLUDE) : (dir_only ? EXCLUDE_DIR : EXCLUDE);
+        push(Node::SUBTREE).flags = include ? INCLUDE : EXCLUDE;
+        // the compiled states no longer match the pattern set
+        state_ids.clear();
+        states.clear();
+        transitions.clear();
+        state_flags.clear();
+    }
+
+    // "**/" may only match nothing at the start of a path component, so
+    // ANYDIRS skips ahead only when boundary is set
+    void closure(std::vector<uint32_t>& set, bool boundary) const {
+        std::vector<bool> in(nodes.size());
+        for (auto n : set) in[n] = true;
+        for (size_t i = 0; i < set.size(); i++) {
+            auto kind = nodes[set[i]].kind;
+            if (kind == Node::STAR || kind == Node::ANYPATH || (boundary && kind == Node::ANYDIRS)) {
+                uint32_t next = set[i] + 1;
+                if (!in[next]) {
+                    in[next] = true;
+                    set.emplace_back(next);
+                }
+            }
+        }
+        std::sort(set.begin(), set.end());
+    }
+
+    int intern(std::vector<uint32_t>&& set) {
+        auto it = state_ids.find(set);
+        if (it != state_ids.end()) {
+            return it->second;
+        }
+        int id = (int)states.size();
+        uint8_t flags = 0;
+        for (auto n : set) {
+            flags |= nodes[n].flags;
+            if (nodes[n].include) flags |= INCLUDE_ALIVE;
+        }
+        state_ids.emplace(set, id);
+        states.emplace_back(std::move(set));
+        std::array<int, 256> t;
+        t.fill(-1);
+        transitions.emplace_back(t);
+        state_flags.emplace_back(flags);
+        return id;
+    }
+
+    int start() {
+        if (states.empty()) {
+            std::vector<uint32_t> set(starts.begin(), starts.end());
+            closure(set, true);
+            intern(std::move(set));
+        }
+        return 0;
+    }
+
+    int feed(int state, uint8_t c) {
+        int next = transitions[state][c];
+        if (next != -1) {
+            return next;
+        }
+        std::vector<uint32_t> set;
+        for (auto n : states[state]) {
+            const Node& node = nodes[n];
+            switch (node.kind) {
+                case Node::CHARS:
+                    if (node.chars[c]) set.emplace_back(n + 1);
+                    break;
+                case Node::STAR:
+                    if (c != '/') set.emplace_back(n);
+                    break;
+                case Node::ANYPATH:
+                case Node::SUBTREE:
+                    set.emplace_back(n);
+                    break;
+                case Node::ANYDIRS:
+                    set.emplace_back(n);
+                    break;
+                case Node::ACCEPT:
+                    if (c == '/') set.emplace_back(n + 1);
+                    break;
+            }
+        }
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        closure(set, c == '/');
+        next = intern(std::move(set));
+        transitions[state][c] = next;
+        return next;
+    }
+
+    int feed(int state, const std::string& s) {
+        for (char c : s) {
+            state = feed(state, (uint8_t)c);
+        }
+        return state;
+    }
+
+    bool excluded(int state, bool is_dir) const {
+        uint8_t f = state_flags[state];
+        bool ex = (f & EXCLUDE) || (is_dir && (f & EXCLUDE_DIR));
+        bool in = (f & INCLUDE) || (is_dir && (f & INCLUDE_DIR));
+        return ex && !in;
+    }
+
+    bool include_alive(int state) const {
+        return (state_flags[state] & INCLUDE_ALIVE) != 0;
+    }
+
+    bool included(int state, bool is_dir) const {
+        uint8_t f = state_flags[state];
+        return (f & INCLUDE) || (is_dir && (f & INCLUDE_DIR));
+    }
+};
+
+// reads a list of paths from a file, or stdin if name is "-"
+//
+// entries are NUL separated if the list contains a NUL, otherwise newline separated
+//
+bool read_path_list(const std::string& name, std::vector<std::string>& paths) {
+    FILE* f = name == "-" ? stdin : fopen(name.c_str(), "rb");
+    if (f == nullptr) {
+        auto se = errno;
+        fmt::print("failed to open item {}\nerrno: -{} ({})\n", name, se, fmt::system_error(se, ""));
+        return false;
+    }
+    std::string list;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) != 0) {
+        list.append(buf, n);
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    char sep = list.find('\0') != std::string::npos ? '\0' : '\n';
+    size_t start = 0;
+    while (start < list.length()) {
+        size_t end = list.find(sep, start);
+        if (end == std::string::npos) end = list.length();
+        std::string entry = list.substr(start, end - start);
+        if (sep == '\n' && !entry.empty() && entry.back() == '\r') {
+            entry.pop_back();
+        }
+        if (!entry.empty()) {
+            paths.emplace_back(std::move(entry));
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
 #ifdef HAVE_LSTAT
 std::string get_symlink_dest(const std::filesystem::path& path, const struct stat & st) {
     if ((st.st_mode & S_IFMT) == S_IFLNK) {
@@ -394,85 +1626,1359 @@ std::string get_symlink_dest(const std::filesystem::path& path, const struct sta
             free(buf);
             return "";
         }
-        buf[path_size - 1] = '\0';
-        std::string pstr = buf;
-        free(buf);
-        return pstr;
-    }
-    else {
-        return "";
+        buf[path_size - 1] = '\0';
+        std::string pstr = buf;
+        free(buf);
+        return pstr;
+    }
+    else {
+        return "";
+    }
+}
+
+std::string get_symlink_dest(const std::filesystem::path& path) {
+    struct stat st;
+    if (!get_stats(path, st)) return "";
+    return get_symlink_dest(path, st);
+}
+#endif
+
+// page aligned buffers, freed with free_aligned
+void* malloc_aligned(size_t size) {
+#ifdef _WIN32
+    void* p = _aligned_malloc(size, 4096);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, 4096, size) != 0) {
+        p = nullptr;
+    }
+#endif
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void free_aligned(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// split files are read through plain descriptors at the offset of each chunk
+int open_read_fd(const char* path) {
+#ifdef _WIN32
+    return _open(path, _O_RDONLY | _O_BINARY);
+#else
+    return ::open(path, O_RDONLY);
+#endif
+}
+
+int open_write_fd(const char* path, bool truncate = true) {
+#ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | (truncate ? _O_TRUNC : 0) | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return ::open(path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0666);
+#endif
+}
+
+void close_fd(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+// sets the size of a file, anything past it is cut off
+bool truncate_fd(int fd, uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(fd, (int64_t)size) == 0;
+#else
+    return ftruncate(fd, (off_t)size) == 0;
+#endif
+}
+
+// returns the number of bytes read, 0 at the end of the file or -1 on error
+int64_t read_at(int fd, void* buffer, size_t size, uint64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, (int64_t)offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    return _read(fd, buffer, (unsigned int)std::min<size_t>(size, INT_MAX));
+#else
+    return pread(fd, buffer, size, (off_t)offset);
+#endif
+}
+
+#ifndef _WIN32
+struct timespec stat_mtime(const struct stat& st) {
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+#endif
+
+// waits for an exclusive lock on the whole file, it is released when the
+// file is closed
+bool lock_file(FILE* f) {
+#ifdef _WIN32
+    OVERLAPPED overlapped = {};
+    return LockFileEx((HANDLE)_get_osfhandle(_fileno(f)), LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+#else
+    return flock(fileno(f), LOCK_EX) == 0;
+#endif
+}
+
+// returns the number of bytes written or -1 on error, on windows the file
+// position moves so a descriptor must not be shared between threads there
+int64_t write_at(int fd, const void* buffer, size_t size, uint64_t offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, (int64_t)offset, SEEK_SET) == -1) {
+        return -1;
+    }
+    return _write(fd, buffer, (unsigned int)std::min<size_t>(size, INT_MAX));
+#else
+    return pwrite(fd, buffer, size, (off_t)offset);
+#endif
+}
+
+// the splits a join has open, the least recently used one is closed once
+// MAX_OPEN are open
+struct SplitFiles {
+    static const size_t MAX_OPEN = 16;
+
+    std::list<std::pair<uint64_t, int>> files;
+
+    // returns the descriptor of a split, opening it if needed, or -1
+    int get(uint64_t split, const std::string& path) {
+        for (auto it = files.begin(); it != files.end(); it++) {
+            if (it->first == split) {
+                files.splice(files.begin(), files, it);
+                return it->second;
+            }
+        }
+        int fd = open_read_fd(path.c_str());
+        if (fd == -1) {
+            return -1;
+        }
+        if (files.size() == MAX_OPEN) {
+            close_fd(files.back().second);
+            files.pop_back();
+        }
+        files.emplace_front(split, fd);
+        return fd;
+    }
+
+    void close(uint64_t split) {
+        for (auto it = files.begin(); it != files.end(); it++) {
+            if (it->first == split) {
+                close_fd(it->second);
+                files.erase(it);
+                return;
+            }
+        }
+    }
+
+    void close_all() {
+        for (auto& file : files) {
+            close_fd(file.second);
+        }
+        files.clear();
+    }
+
+    ~SplitFiles() {
+        close_all();
+    }
+};
+
+#ifndef _WIN32
+// the directories of a local join kept open, entries are created relative
+// to them instead of resolving their whole path each time, a directory
+// missing from the cache is opened relative to the output directory
+struct DirFiles {
+    static const size_t MAX_OPEN = 16;
+
+    int root = -1;
+    std::list<std::pair<std::string, int>> dirs;
+
+    bool open(const std::string& path) {
+        close_all();
+        root = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return root != -1;
+    }
+
+    // returns the descriptor of a directory below the output directory, or -1
+    int get(const std::string& dir) {
+        if (dir.empty()) {
+            return root;
+        }
+        for (auto it = dirs.begin(); it != dirs.end(); it++) {
+            if (it->first == dir) {
+                dirs.splice(dirs.begin(), dirs, it);
+                return it->second;
+            }
+        }
+        int fd = openat(root, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            return -1;
+        }
+        if (dirs.size() == MAX_OPEN) {
+            ::close(dirs.back().second);
+            dirs.pop_back();
+        }
+        dirs.emplace_front(dir, fd);
+        return fd;
+    }
+
+    // returns the descriptor of the directory holding path and sets name to
+    // the last component of path
+    int parent(const char* path, const char*& name) {
+        const char* slash = strrchr(path, '/');
+        if (slash == nullptr) {
+            name = path;
+            return root;
+        }
+        name = slash + 1;
+        return get(std::string(path, slash - path));
+    }
+
+    void close_all() {
+        for (auto& dir : dirs) {
+            ::close(dir.second);
+        }
+        dirs.clear();
+        if (root != -1) {
+            ::close(root);
+            root = -1;
+        }
+    }
+
+    ~DirFiles() {
+        close_all();
+    }
+};
+#endif
+
+// the path converter is done, any path is now converted into a path relative to .
+//
+// [root]  ..       > .
+// [child] ../foo   > foo
+// [child] ../foo/a > foo/a
+// [root]  ../dir   > .
+// [child] ../dir/a > a
+// [root]  /        > .
+// [child] /a/f/g   > a/f/g
+// [root]  /a/      > .
+// [child] /a/f/g   > f/g
+//
+struct PathRecorder {
+    std::string trim = {};
+    BinWriter w = {};
+    BinReader r = {};
+    uint64_t unknowns = 0;
+
+    struct ChunkInfo {
+        uintmax_t split = 0;
+        uintmax_t offset = 0;
+        uintmax_t length = 0;
+    };
+
+    // walks the chunks of a file as stored in the split map
+    //
+    // version 1 lists every chunk, version 2 only stores where the file
+    // starts since the remaining chunks always begin at offset 0 of the
+    // following splits
+    //
+    struct ChunkCursor {
+        BinReader* r = nullptr;
+        uint64_t count = 0;
+        uint64_t split = 0;
+        uint64_t offset = 0;
+        uint64_t left = 0;
+
+        ChunkInfo next() {
+            ChunkInfo chunk;
+            if (r->version < 2) {
+                chunk.split = r->read_u64();
+                chunk.offset = r->read_u64();
+                chunk.length = r->read_u64();
+                return chunk;
+            }
+            chunk.split = split;
+            chunk.offset = offset;
+            chunk.length = std::min<uint64_t>(left, SPLIT_SIZE - offset);
+            left -= chunk.length;
+            split++;
+            offset = 0;
+            return chunk;
+        }
+    };
+
+    ChunkCursor read_chunks(uint64_t file_size) {
+        return read_chunks(r, file_size);
+    }
+
+    ChunkCursor read_chunks(BinReader& r, uint64_t file_size) {
+        ChunkCursor cursor;
+        cursor.r = &r;
+        if (r.version < 2) {
+            cursor.count = r.read_u64();
+            return cursor;
+        }
+        if (file_size == 0) {
+            return cursor;
+        }
+        cursor.split = r.read_u64();
+        cursor.offset = r.read_u64();
+        cursor.left = file_size;
+        if (cursor.offset >= SPLIT_SIZE) {
+            throw std::runtime_error("chunk offset out of range");
+        }
+        uint64_t first = std::min<uint64_t>(file_size, SPLIT_SIZE - cursor.offset);
+        cursor.count = 1 + (file_size - first + SPLIT_SIZE - 1) / SPLIT_SIZE;
+        return cursor;
+    }
+
+    struct DirInfo {
+        std::filesystem::path path;
+        std::string perms;
+        uint16_t mode = 0;
+        std::filesystem::file_time_type::rep write_time;
+        bool keep = false; // a parent recorded for --files-from, never removed by -r
+    };
+    struct FileInfo {
+        std::filesystem::path path;
+        std::string perms;
+        uint16_t mode = 0;
+        std::filesystem::file_time_type::rep write_time;
+        uintmax_t file_size;
+        std::vector<ChunkInfo> file_chunks;
+    };
+    
+    struct SymlinkInfo {
+        std::filesystem::path path;
+        std::filesystem::path dest;
+    };
+
+    GlobMatcher filter = {};
+
+    // the --only patterns of a join, entries they leave out are skipped and
+    // their chunks never read, the directories above a selected entry are
+    // created without restoring their permissions or times
+    GlobMatcher only = {};
+    std::unordered_set<std::string> made_dirs = {};
+
+    bool selected(const char* path, bool is_dir) {
+        return only.empty() || only.included(only.feed(only.start(), path), is_dir);
+    }
+
+    // a shard map is only read if its directory may hold a selected entry
+    bool selected_shard(const std::string& key) {
+        if (only.empty()) {
+            return true;
+        }
+        int state = only.feed(only.start(), key);
+        return only.included(state, true) || only.include_alive(only.feed(state, '/'));
+    }
+
+    bool make_parents(const char* path) {
+        if (only.empty()) {
+            return true;
+        }
+        const char* slash = strrchr(path, '/');
+        if (slash == nullptr) {
+            return true;
+        }
+        std::string dir(path, slash - path);
+        if (!made_dirs.insert(dir).second) {
+            return true;
+        }
+        if (dry_run) {
+            fmt::print("mkdir -p {}/{}\n", out_directory, dir);
+            return true;
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(out_directory + "/" + dir, ec);
+        if (ec) {
+            fmt::print("failed to create directory: {}/{}\n", out_directory, dir);
+            return false;
+        }
+        return true;
+    }
+
+    // a shard map holds everything below one directory at SHARD_DEPTH, the
+    // root map lists the shards in the order their data was packed
+    struct ShardInfo {
+        std::string key;
+        uint64_t first_split = UINT64_MAX;
+        uint64_t dirs = 0;
+        uint64_t files = 0;
+        uint64_t symlinks = 0;
+    };
+
+    std::vector<ShardInfo> shards = {};
+
+    // set while joining the maps of a sharded split map
+    struct DeferredDir {
+        std::string path;
+        std::string perms;
+        std::filesystem::file_time_type::rep time;
+    };
+
+    bool joining_shard = false;
+    bool defer_dirs = false;
+    std::vector<DeferredDir> deferred_dirs = {};
+    uint64_t keep_split_from = UINT64_MAX;
+
+    std::vector<DirInfo> bird_is_the_word_d = {};
+    std::vector<FileInfo> bird_is_the_word_f = {};
+    std::vector<SymlinkInfo> bird_is_the_word_s = {};
+
+    enum INDEX_KIND : uint8_t {
+        INDEX_DIR, INDEX_FILE, INDEX_SYMLINK
+    };
+
+    // an entry of the path index at the end of version 2 maps
+    struct IndexEntry {
+        std::string path;
+        uint8_t kind = INDEX_DIR;
+        uint64_t offset = 0;
+        uint64_t subtree = 0;
+    };
+
+    // section offsets read from the toc of version 2 maps
+    struct MapToc {
+        uint64_t dirs = 0;
+        uint64_t files = 0;
+        uint64_t symlinks = 0;
+        uint64_t index = 0;
+        uint64_t restarts = 0;
+        uint64_t bloom = 0;
+        uint64_t blocks = 0;
+        uint64_t summary = 0;
+    };
+
+    // statistics of the whole archive, gathered while packing so a summary
+    // does not need to decode the entries
+    struct MapSummary {
+        struct Bucket {
+            uint64_t files = 0;
+            uint64_t bytes = 0;
+        };
+        struct Entry {
+            std::string name;
+            uint64_t dirs = 0;
+            uint64_t files = 0;
+            uint64_t symlinks = 0;
+            uint64_t bytes = 0;
+        };
+        struct Split {
+            uint64_t bytes = 0;
+            uint64_t chunks = 0;
+        };
+        std::vector<Bucket> sizes;
+        std::vector<Entry> top;
+        std::vector<Split> splits;
+    };
+
+    // a run of entries of a section that decodes without the ones before it
+    struct MapBlock {
+        uint64_t offset = 0;
+        uint64_t first = 0;
+    };
+
+    struct MapBlocks {
+        std::vector<MapBlock> dirs;
+        std::vector<MapBlock> files;
+        std::vector<MapBlock> symlinks;
+    };
+
+    std::vector<IndexEntry> index_entries = {};
+    MapBlocks blocks = {};
+    MapSummary summary = {};
+
+    int split_number = 0;
+    bool first_split = true;
+    bool open = false;
+    uintmax_t current_chunk_size = 0;
+    uintmax_t chunk_size = SPLIT_SIZE;
+    uintmax_t total_chunk_count = 0;
+    uintmax_t max_file_chunks = 0;
+    uintmax_t total = 0;
+    uintmax_t totalc = 0;
+
+    std::string max_path = {};
+    uint64_t max_perms = 0;
+    std::string max_perms_str = {};
+    uintmax_t max_size = 0;
+    uintmax_t max_chunk = 0;
+    FILE* current_split_file = nullptr;
+    SplitLayout layout = {};
+    std::vector<std::filesystem::path> current_split_dirs = {};
+    std::vector<std::unique_ptr<SplitWriter>> writers = {};
+    SplitWriter* current_writer = nullptr;
+
+    // the largest read/write issued while packing or joining, keeps memory independent of the split size
+    static const uintmax_t IO_BLOCK = 4096 * 1024;
+
+    // a copy that cannot be left to the kernel goes through a ring of
+    // COPY_RING blocks, one is read while the one before it is written
+    static const size_t COPY_RING = 2;
+
+    // the ring chunks are copied through when joining from a URL, allocated on first use
+    std::unique_ptr<uint8_t, void(*)(void*)> copy_buffer = { nullptr, free_aligned };
+
+    // cleared once copy_file_range is found unsupported between the splits and the output
+    std::atomic<bool> kernel_copy = { true };
+
+    // copies length bytes at in_off of a split to out_off of a file, returns
+    // false on a short read or a failed write, safe to call from several
+    // threads with their own buffers
+    //
+    // on linux the kernel copies the bytes without passing them through user
+    // space, filesystems with reflinks share them instead, anything else goes
+    // through the ring of COPY_RING * IO_BLOCK bytes at buffer
+    //
+    bool _copy_range(int in, uint64_t in_off, int out, uint64_t out_off, uintmax_t length, uint8_t* buffer) {
+#if defined(__linux__)
+        if (kernel_copy && length != 0) {
+            off_t src = (off_t)in_off;
+            off_t dst = (off_t)out_off;
+            while (length != 0) {
+                ssize_t n = copy_file_range(in, &src, out, &dst, (size_t)std::min<uintmax_t>(length, 1 << 30), 0);
+                if (n > 0) {
+                    length -= (uintmax_t)n;
+                    continue;
+                }
+                if (n == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    kernel_copy = false;
+                    break;
+                }
+                return false;
+            }
+            in_off = (uint64_t)src;
+            out_off = (uint64_t)dst;
+        }
+#endif
+        if (length > IO_BLOCK) {
+            return _copy_ring(in, in_off, out, out_off, length, buffer);
+        }
+        if (length == 0) {
+            return true;
+        }
+        int64_t n = read_at(in, buffer, (size_t)length, in_off);
+        return n == (int64_t)length && _write_block(out, buffer, (size_t)n, out_off);
+    }
+
+    static bool _write_block(int out, const uint8_t* buffer, size_t size, uint64_t offset) {
+        for (size_t done = 0; done < size;) {
+            int64_t w = write_at(out, buffer + done, size - done, offset + done);
+            if (w <= 0) {
+                return false;
+            }
+            done += (size_t)w;
+        }
+        return true;
+    }
+
+    // copies through the ring, a reader thread stays at most COPY_RING - 1
+    // blocks ahead of the calling thread writing them out, so reading a
+    // split and writing the file overlap even when they are on different devices
+    bool _copy_ring(int in, uint64_t in_off, int out, uint64_t out_off, uintmax_t length, uint8_t* buffer) {
+        std::mutex m;
+        std::condition_variable cv;
+        uint64_t blocks = (length + IO_BLOCK - 1) / IO_BLOCK;
+        uint64_t filled = 0;
+        uint64_t written = 0;
+        bool failed = false;
+        int64_t sizes[COPY_RING];
+        std::thread reader([&] {
+            for (uint64_t k = 0; k < blocks; k++) {
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    cv.wait(lock, [&] { return k - written < COPY_RING || failed; });
+                    if (failed) {
+                        return;
+                    }
+                }
+                size_t block = (size_t)std::min<uintmax_t>(length - k * IO_BLOCK, IO_BLOCK);
+                int64_t n = read_at(in, buffer + (k % COPY_RING) * IO_BLOCK, block, in_off + k * IO_BLOCK);
+                std::lock_guard<std::mutex> lock(m);
+                if (n != (int64_t)block) {
+                    failed = true;
+                }
+                else {
+                    sizes[k % COPY_RING] = n;
+                    filled = k + 1;
+                }
+                cv.notify_all();
+                if (failed) {
+                    return;
+                }
+            }
+        });
+        for (uint64_t k = 0; k < blocks; k++) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [&] { return filled > k || failed; });
+                if (filled <= k) {
+                    break;
+                }
+            }
+            bool ok = _write_block(out, buffer + (k % COPY_RING) * IO_BLOCK, (size_t)sizes[k % COPY_RING], out_off + k * IO_BLOCK);
+            std::lock_guard<std::mutex> lock(m);
+            if (!ok) {
+                failed = true;
+            }
+            else {
+                written = k + 1;
+            }
+            cv.notify_all();
+            if (failed) {
+                break;
+            }
+        }
+        reader.join();
+        return !failed;
+    }
+
+    // copies a chunk at the given offset of a split to the end of a stream
+    bool _copy_chunk(int in, uint64_t offset, FILE* out, uintmax_t length) {
+        if (!copy_buffer) {
+            copy_buffer.reset((uint8_t*)malloc_aligned(COPY_RING * IO_BLOCK));
+        }
+        if (fflush(out) != 0) {
+            return false;
+        }
+        int64_t pos = ftello(out);
+        if (pos < 0 || !_copy_range(in, offset, fileno(out), (uint64_t)pos, length, copy_buffer.get())) {
+            return false;
+        }
+        return fseeko(out, pos + (int64_t)length, SEEK_SET) == 0;
+    }
+
+    // a local join restores files in batches, the pieces of a batch are copied
+    // by a pool of threads, a piece is a chunk or at most JOIN_PIECE bytes of
+    // one so large files are written by several threads at once
+    static const uintmax_t JOIN_PIECE = 64 * 1024 * 1024;
+    static const size_t JOIN_BATCH_FILES = 256;
+    static const uintmax_t JOIN_BATCH_BYTES = 1024 * 1024 * 1024;
+
+    struct JoinFile {
+        std::string path;
+        std::string perms;
+        std::filesystem::file_time_type::rep time;
+        int fd = -1;
+        bool complete = true; // false while a --splits join leaves fragments to another
+        std::vector<uint64_t> splits; // its splits a --splits join found not yet joined
+    };
+
+    struct JoinPiece {
+        size_t file;
+        uint64_t split;
+        uint64_t split_offset;
+        uint64_t file_offset;
+        uint64_t length;
+    };
+
+    struct JoinBatch {
+        std::vector<JoinFile> files;
+        std::vector<JoinPiece> pieces;
+        uint64_t first_split = UINT64_MAX;
+        uint64_t last_split = 0;
+        uintmax_t bytes = 0;
+    };
+
+    JoinBatch join_batch = {};
+
+    // the state of each split in a --splits join, the splits finished by
+    // earlier joins of the same split map are listed in {map}.done
+    enum : uint8_t {
+        SPLIT_PENDING,
+        SPLIT_WANTED,
+        SPLIT_DONE
+    };
+    std::vector<uint8_t> split_state = {};
+    std::string split_journal;
+    // every wanted split below this one has been copied, the rest of a join
+    // that fails is left to the next one
+    uint64_t split_copied = 0;
+    // the files a --splits join wrote part of, finished once the journal
+    // lists all of their splits
+    std::vector<JoinFile> split_unfinished;
+    SplitLayout split_layout;
+    std::string split_layout_base;
+
+    bool split_wanted(uint64_t split) const {
+        return split < split_state.size() && split_state[split] == SPLIT_WANTED;
+    }
+
+    bool split_done(uint64_t split) const {
+        return split < split_state.size() && split_state[split] != SPLIT_PENDING;
+    }
+
+    // reads the journal and picks the splits of a --splits join, a list of
+    // split numbers and ranges like 17-42, or present for every split whose
+    // file is complete, a split is complete once it has the size the split
+    // fill of the summary records for it
+    //
+    // a split map without a summary only knows the size of full splits, so
+    // present leaves its last split out unless it is named
+    //
+    int _splits_begin(const char* path) {
+        split_state.clear();
+        split_copied = 0;
+        split_unfinished.clear();
+        if (JOIN_SPLITS.empty()) {
+            return 0;
+        }
+        if (is_url(path)) {
+            fmt::print("--splits requires a local split map\n");
+            return -1;
+        }
+        MapHeader header;
+        if (read_header(path, header) == -1) {
+            return -1;
+        }
+        MapToc toc;
+        bool fill = read_toc(toc) && (r.flags & MAP_FLAG_SUMMARY) != 0;
+        if (fill) {
+            read_summary(toc);
+        }
+        r.close();
+        shards.clear();
+        auto parent = std::filesystem::canonical(std::filesystem::absolute(path)).parent_path();
+        split_layout = header.layout;
+        split_layout_base = fmt::format("{}/", parent);
+        uint64_t count = header.split_number + 1;
+        std::vector<uint8_t> state(count, SPLIT_PENDING);
+        split_journal = fmt::format("{}.done", path);
+        FILE* f = fopen(split_journal.c_str(), "rb");
+        if (f != nullptr) {
+            unsigned long long split;
+            while (fscanf(f, "%llu", &split) == 1) {
+                if (split < count) {
+                    state[split] = SPLIT_DONE;
+                }
+            }
+            fclose(f);
+        }
+        // a split number is nothing but digits
+        auto parse_split = [](const std::string& str, uint64_t& split) {
+            if (str.empty() || str[0] < '0' || str[0] > '9') {
+                return false;
+            }
+            char* end;
+            errno = 0;
+            split = strtoull(str.c_str(), &end, 10);
+            return *end == '\0' && errno == 0;
+        };
+        std::string_view spec = JOIN_SPLITS;
+        while (!spec.empty()) {
+            size_t comma = spec.find(',');
+            std::string item(spec.substr(0, comma));
+            spec = comma == std::string_view::npos ? std::string_view() : spec.substr(comma + 1);
+            if (item == "present") {
+                for (uint64_t split = 0; split < count; split++) {
+                    if (!fill && split + 1 == count) {
+                        break;
+                    }
+                    uint64_t expected = !fill ? SPLIT_SIZE : split < summary.splits.size() ? summary.splits[split].bytes : 0;
+                    std::error_code ec;
+                    auto size = std::filesystem::file_size(split_layout.locate(split_layout_base, split), ec);
+                    if (!ec && size == expected && state[split] == SPLIT_PENDING) {
+                        state[split] = SPLIT_WANTED;
+                    }
+                }
+                continue;
+            }
+            size_t dash = item.find('-');
+            uint64_t first = 0, last = 0;
+            bool ok = parse_split(item.substr(0, dash), first);
+            if (dash == std::string::npos) {
+                last = first;
+            }
+            else {
+                ok = ok && parse_split(item.substr(dash + 1), last);
+            }
+            if (!ok || first > last) {
+                fmt::print("invalid split range: {}\n", item);
+                return -1;
+            }
+            if (last >= count) {
+                fmt::print("split range {} is outside of splits 0-{}\n", item, count - 1);
+                return -1;
+            }
+            for (uint64_t split = first; split <= last; split++) {
+                if (state[split] == SPLIT_PENDING) {
+                    state[split] = SPLIT_WANTED;
+                }
+            }
+        }
+        uint64_t wanted = std::count(state.begin(), state.end(), SPLIT_WANTED);
+        uint64_t done = std::count(state.begin(), state.end(), SPLIT_DONE);
+        fmt::print("joining {} of {} splits, {} already joined\n", wanted, count, done);
+        split_state = std::move(state);
+        return 0;
+    }
+
+    // records the splits a --splits join finished, with -r they are removed,
+    // a join that failed only records the splits it copied before that
+    //
+    // the journal is locked while it is read again and appended to, so of
+    // two joins that write parts of the same file the one that ends last
+    // sees every split of it and gives it its permissions and time
+    //
+    int _splits_end(bool finished) {
+        uint64_t pending = 0;
+        for (uint64_t split = finished ? split_state.size() : split_copied; split < split_state.size(); split++) {
+            if (split_state[split] == SPLIT_WANTED) {
+                split_state[split] = SPLIT_PENDING;
+            }
+        }
+        FILE* f = fopen(split_journal.c_str(), dry_run ? "rb" : "ab+");
+        if (f == nullptr && !dry_run) {
+            fmt::print("failed to open file: {}\n", split_journal);
+            return -1;
+        }
+        if (f != nullptr) {
+            if (!dry_run && !lock_file(f)) {
+                fmt::print("failed to lock file: {}\n", split_journal);
+                fclose(f);
+                return -1;
+            }
+            // the splits other joins finished since this one began
+            rewind(f);
+            unsigned long long split;
+            while (fscanf(f, "%llu", &split) == 1) {
+                if (split < split_state.size() && split_state[split] == SPLIT_PENDING) {
+                    split_state[split] = SPLIT_DONE;
+                }
+            }
+            fseek(f, 0, SEEK_END);
+        }
+        for (uint64_t split = 0; split < split_state.size(); split++) {
+            if (split_state[split] == SPLIT_PENDING) {
+                pending++;
+            }
+            if (split_state[split] != SPLIT_WANTED) {
+                continue;
+            }
+            if (dry_run) {
+                if (remove_files) {
+                    fmt::print("rm -f {}\n", split_layout.locate(split_layout_base, split));
+                }
+                continue;
+            }
+            // fmt writes into the stdio buffer itself and does not turn a stream that was read around
+            fprintf(f, "%llu\n", (unsigned long long)split);
+            split_state[split] = SPLIT_DONE;
+            if (remove_files) {
+                remove_split(split_layout, split_layout_base, split);
+            }
+        }
+        if (f != nullptr) {
+            fclose(f);
+        }
+        int ret = 0;
+        for (auto& file : split_unfinished) {
+            bool done = std::all_of(file.splits.begin(), file.splits.end(), [&](uint64_t split) {
+                return split_state[split] == SPLIT_DONE;
+            });
+            if (done && !_join_finish(file)) {
+                ret = -1;
+            }
+        }
+        split_unfinished.clear();
+        if (pending == 0) {
+            fmt::print("every split has been joined\n");
+            if (!dry_run) {
+                std::error_code ec;
+                std::filesystem::remove(split_journal, ec);
+            }
+        }
+        return ret;
+    }
+
+    // gives a file of a --splits join its permissions and time once its
+    // descriptor is closed
+    bool _join_finish(const JoinFile& file) {
+        std::error_code ec;
+        std::filesystem::permissions(file.path, permissions_to_filesystem(string_to_permissions(file.perms.c_str())), ec);
+        if (!ec) {
+            std::filesystem::last_write_time(file.path, std::filesystem::file_time_type(std::filesystem::file_time_type::duration(file.time)), ec);
+        }
+        if (ec) {
+            fmt::print("failed to set the permissions or time of file: {}\n", file.path);
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<std::unique_ptr<uint8_t, void(*)(void*)>> join_buffers = {};
+
+#ifndef _WIN32
+    DirFiles join_dirs = {};
+
+    // std::filesystem times count from an epoch each standard library picks,
+    // the distance to the unix epoch is measured on the output directory
+    std::chrono::nanoseconds file_clock_offset = {};
+
+    bool _join_open_dirs() {
+        if (!join_dirs.open(out_directory)) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(join_dirs.root, &st) != 0) {
+            return false;
+        }
+        struct timespec ts = stat_mtime(st);
+        auto mtime = std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+        auto file_time = std::filesystem::last_write_time(out_directory).time_since_epoch();
+        file_clock_offset = std::chrono::duration_cast<std::chrono::nanoseconds>(file_time) - mtime;
+        return true;
+    }
+
+    struct timespec _unix_time(std::filesystem::file_time_type::rep time) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::filesystem::file_time_type::duration(time)) - file_clock_offset;
+        auto sec = std::chrono::floor<std::chrono::seconds>(ns);
+        struct timespec ts;
+        ts.tv_sec = (time_t)sec.count();
+        ts.tv_nsec = (long)(ns - sec).count();
+        return ts;
+    }
+#endif
+
+    // creates a directory of a join, with --update an existing directory is
+    // kept and anything else in its place is replaced
+    bool _join_mkdir(const char* dir) {
+#ifndef _WIN32
+        if (join_dirs.root != -1) {
+            const char* name;
+            int at = join_dirs.parent(dir, name);
+            if (at == -1) {
+                return false;
+            }
+            if (mkdirat(at, name, 0777) == 0) {
+                return true;
+            }
+            struct stat st;
+            if (!JOIN_UPDATE || errno != EEXIST || fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                return false;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                return true;
+            }
+            return unlinkat(at, name, 0) == 0 && mkdirat(at, name, 0777) == 0;
+        }
+#endif
+        std::filesystem::path p = out_directory + "/" + dir;
+        std::error_code ec;
+        if (JOIN_UPDATE) {
+            auto status = std::filesystem::symlink_status(p, ec);
+            if (std::filesystem::is_directory(status)) {
+                return true;
+            }
+            if (std::filesystem::exists(status)) {
+                std::filesystem::remove(p, ec);
+            }
+        }
+        return std::filesystem::create_directory(p, ec);
+    }
+
+    // with --update, true if the file on disk already has the size and time
+    // recorded in the map, its permissions are updated in place, anything
+    // other than a regular file in its place is removed
+    //
+    // a local join looks the file up with one stat relative to its open directory
+    //
+    bool _join_unchanged(const char* path, uint64_t size, std::filesystem::file_time_type::rep time, const char* perms) {
+        if (!JOIN_UPDATE || resume_reached || !split_state.empty()) {
+            return false;
+        }
+        if (JOIN_RESUME && !_join_on_disk(path, size, time, perms)) {
+            fmt::print("resuming at file: {}/{}\n", out_directory, path);
+            resume_reached = true;
+            return false;
+        }
+        return JOIN_RESUME || _join_on_disk(path, size, time, perms);
+    }
+
+    // a file gets its time once all of its chunks are written and the files
+    // of a join finish in map order, so --resume stops looking at what is on
+    // disk after the first file that is not finished
+    bool resume_reached = false;
+
+    bool _join_on_disk(const char* path, uint64_t size, std::filesystem::file_time_type::rep time, const char* perms) {
+        std::filesystem::path p = out_directory + "/" + path;
+        std::error_code ec;
+#ifndef _WIN32
+        if (join_dirs.root != -1) {
+            const char* name;
+            int at = join_dirs.parent(path, name);
+            struct stat st;
+            if (at == -1 || fstatat(at, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                return false;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                std::filesystem::remove_all(p, ec);
+                return false;
+            }
+            if (!S_ISREG(st.st_mode)) {
+                unlinkat(at, name, 0);
+                return false;
+            }
+            struct timespec on_disk = stat_mtime(st);
+            struct timespec in_map = _unix_time(time);
+            if ((uint64_t)st.st_size != size || on_disk.tv_sec != in_map.tv_sec || on_disk.tv_nsec != in_map.tv_nsec) {
+                return false;
+            }
+            mode_t mode = string_to_permissions(perms).st_mode & 07777;
+            if ((st.st_mode & 07777) != mode) {
+                fchmodat(at, name, mode, 0);
+            }
+            return true;
+        }
+#endif
+        auto status = std::filesystem::symlink_status(p, ec);
+        if (ec || !std::filesystem::exists(status)) {
+            return false;
+        }
+        if (!std::filesystem::is_regular_file(status)) {
+            if (dry_run) {
+                fmt::print("rm -rf {}\n", p);
+            }
+            else {
+                std::filesystem::remove_all(p, ec);
+            }
+            return false;
+        }
+        if (std::filesystem::file_size(p, ec) != size || ec) {
+            return false;
+        }
+        if (std::filesystem::last_write_time(p, ec).time_since_epoch().count() != time || ec) {
+            return false;
+        }
+        if (!dry_run) {
+            std::filesystem::permissions(p, permissions_to_filesystem(string_to_permissions(perms)), ec);
+        }
+        return true;
+    }
+
+    // with --update, true if the symlink on disk already points at dest,
+    // anything else in its place is removed
+    bool _join_same_link(const char* path, std::string_view dest) {
+        if (!JOIN_UPDATE) {
+            return false;
+        }
+        std::filesystem::path p = out_directory + "/" + path;
+        std::error_code ec;
+        auto status = std::filesystem::symlink_status(p, ec);
+        if (ec || !std::filesystem::exists(status)) {
+            return false;
+        }
+        if (std::filesystem::is_symlink(status) && std::filesystem::read_symlink(p, ec) == std::filesystem::path(dest) && !ec) {
+            return true;
+        }
+        if (dry_run) {
+            fmt::print("rm -rf {}\n", p);
+        }
+        else {
+            std::filesystem::remove_all(p, ec);
+        }
+        return false;
+    }
+
+    // every entry of the maps played with --delete, anything else below the
+    // output directory is removed once they have all been played
+    std::unordered_set<std::string> join_kept = {};
+
+    void _keep(const char* path) {
+        if (JOIN_DELETE) {
+            join_kept.emplace(path);
+        }
+    }
+
+    int _join_delete_extras() {
+        if (!path_exists(out_directory)) {
+            return 0;
+        }
+        std::vector<std::filesystem::path> extras;
+        std::error_code ec;
+        std::filesystem::recursive_directory_iterator it(out_directory, ec);
+        std::filesystem::recursive_directory_iterator end;
+        for (; !ec && it != end; it.increment(ec)) {
+            if (join_kept.count(it->path().lexically_relative(out_directory).generic_string()) == 0) {
+                extras.emplace_back(it->path());
+                it.disable_recursion_pending();
+            }
+        }
+        if (ec) {
+            fmt::print("failed to list output directory: {}\n", out_directory);
+            return -1;
+        }
+        for (auto& extra : extras) {
+            if (dry_run) {
+                fmt::print("rm -rf {}\n", extra);
+                continue;
+            }
+            if (verbose_files) fmt::print("removing: {}\n", extra);
+            std::filesystem::remove_all(extra, ec);
+            if (ec) {
+                fmt::print("failed to remove path: {}\n", extra);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    // creates a file and queues its chunks, returns false if it cannot be created
+    //
+    // the file is created relative to its open directory and its known size is
+    // reserved up front so the pieces written out of order do not fragment it
+    //
+    // a --splits join only writes the fragments held by the chosen splits, a
+    // file is left alone if they hold none of it and is not truncated since
+    // other joins write the rest of it
+    //
+    bool _join_add(const char* path, const std::string& out_f, const char* perms, std::filesystem::file_time_type::rep time, uint64_t size, ChunkCursor& cursor, const SplitLayout& layout, const std::string& split_base, uint64_t split_number) {
+        JoinFile file;
+        file.path = out_f;
+        file.perms = perms;
+        file.time = time;
+        bool fragments = !split_state.empty();
+        auto create = [&]() {
+            // with --update a stale file is replaced rather than rewritten, it
+            // may be read-only or have other links
+#ifdef _WIN32
+            if (JOIN_UPDATE && !fragments) {
+                std::error_code ec;
+                std::filesystem::remove(out_f, ec);
+            }
+            file.fd = open_write_fd(out_f.c_str(), !fragments);
+#else
+            const char* name;
+            int at = join_dirs.parent(path, name);
+            if (at != -1 && JOIN_UPDATE && !fragments) {
+                unlinkat(at, name, 0);
+            }
+            file.fd = at == -1 ? -1 : openat(at, name, O_WRONLY | O_CREAT | (fragments ? 0 : O_TRUNC) | O_CLOEXEC, 0666);
+#endif
+            if (file.fd != -1 && fragments && !truncate_fd(file.fd, size)) {
+                // an older, longer file would keep its tail, every join cuts it
+                // to the same size and none writes past it
+                close_fd(file.fd);
+                file.fd = -1;
+            }
+#if defined(__linux__)
+            if (file.fd != -1 && size != 0) {
+                // unsupported by some filesystems, the pieces are written either way
+                fallocate(file.fd, 0, 0, (off_t)size);
+            }
+#endif
+            return file.fd != -1;
+        };
+        if (!fragments && !create()) {
+            return false;
+        }
+        uint64_t file_offset = 0;
+        for (uintmax_t i = 0; i < cursor.count; i++) {
+            ChunkInfo chunk = cursor.next();
+            if (fragments && split_state[chunk.split] != SPLIT_DONE && (file.splits.empty() || file.splits.back() != chunk.split)) {
+                file.splits.emplace_back(chunk.split);
+            }
+            if (fragments && !split_wanted(chunk.split)) {
+                file.complete = file.complete && split_done(chunk.split);
+                file_offset += chunk.length;
+                continue;
+            }
+            if (file.fd == -1 && !create()) {
+                return false;
+            }
+            if (join_batch.first_split == UINT64_MAX) {
+                join_batch.first_split = chunk.split;
+            }
+            if (chunk.split > join_batch.last_split || join_batch.pieces.empty()) {
+                prefetch_split(layout, split_base, chunk.split + 1, split_number);
+            }
+            join_batch.last_split = std::max<uint64_t>(join_batch.last_split, chunk.split);
+            for (uint64_t done = 0; done < chunk.length;) {
+                uint64_t length = std::min<uint64_t>(chunk.length - done, JOIN_PIECE);
+                join_batch.pieces.push_back({join_batch.files.size(), chunk.split, chunk.offset + done, file_offset, length});
+                done += length;
+                file_offset += length;
+            }
+            join_batch.bytes += chunk.length;
+        }
+        if (file.fd == -1 && (cursor.count != 0 || !create())) {
+            // nothing of the file is held by the chosen splits, a file whose
+            // splits are all joined is finished here if no join finished it
+            if (cursor.count != 0 && file.complete) {
+                std::error_code ec;
+                auto time = std::filesystem::last_write_time(out_f, ec);
+                if (!ec && time.time_since_epoch().count() != file.time) {
+                    _join_finish(file);
+                }
+            }
+            return cursor.count != 0;
+        }
+        join_batch.files.emplace_back(std::move(file));
+        return true;
     }
-}
 
-std::string get_symlink_dest(const std::filesystem::path& path) {
-    struct stat st;
-    if (!get_stats(path, st)) return "";
-    return get_symlink_dest(path, st);
-}
+    // copies the pieces of the batch on all threads, then applies the metadata
+    // of its files, with -r every split the batch finished is removed, the
+    // last one may still be read by the next batch unless this is the last
+    bool _join_run(const SplitLayout& layout, const std::string& split_base, bool last) {
+        JoinBatch& batch = join_batch;
+        size_t threads = JOIN_THREADS != 0 ? JOIN_THREADS : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+#ifdef _WIN32
+        threads = 1;
 #endif
+        threads = std::max<size_t>(std::min(threads, batch.pieces.size()), 1);
+        while (join_buffers.size() < threads) {
+            join_buffers.emplace_back((uint8_t*)malloc_aligned(COPY_RING * IO_BLOCK), free_aligned);
+        }
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        std::string error;
+        std::mutex error_mutex;
+        std::vector<uint8_t> copied(batch.pieces.size());
+        auto work = [&](uint8_t* buffer) {
+            SplitFiles splits;
+            for (size_t i = next++; i < batch.pieces.size() && !failed; i = next++) {
+                const JoinPiece& piece = batch.pieces[i];
+                std::string in_s = layout.locate(split_base, piece.split);
+                int in = splits.get(piece.split, in_s);
+                bool ok = in != -1 && _copy_range(in, piece.split_offset, batch.files[piece.file].fd, piece.file_offset, piece.length, buffer);
+                copied[i] = ok;
+                if (!ok) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!failed) {
+                        error = in == -1 ? fmt::format("failed to open file: {}", in_s) : fmt::format("failed to copy {} bytes from split {} to file: {}", piece.length, in_s, batch.files[piece.file].path);
+                    }
+                    failed = true;
+                }
+            }
+        };
+        std::vector<std::thread> pool;
+        for (size_t t = 1; t < threads; t++) {
+            pool.emplace_back(work, join_buffers[t].get());
+        }
+        work(join_buffers[0].get());
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        // a file whose pieces were all copied is finished even if others failed
+        std::vector<bool> file_copied(batch.files.size(), true);
+        for (size_t i = 0; failed && i < batch.pieces.size(); i++) {
+            if (!copied[i]) {
+                file_copied[batch.pieces[i].file] = false;
+            }
+        }
+        for (size_t f = 0; f < batch.files.size(); f++) {
+            JoinFile& file = batch.files[f];
+#ifdef _WIN32
+            close_fd(file.fd);
+            if (file_copied[f] && file.complete) {
+                std::filesystem::permissions(file.path, permissions_to_filesystem(string_to_permissions(file.perms.c_str())));
+                std::filesystem::last_write_time(file.path, std::filesystem::file_time_type(std::filesystem::file_time_type::duration(file.time)));
+            }
+#else
+            if (file_copied[f] && file.complete) {
+                // applied on the open descriptor, the times last since any write updates them
+                struct timespec times[2];
+                times[0].tv_sec = 0;
+                times[0].tv_nsec = UTIME_OMIT;
+                times[1] = _unix_time(file.time);
+                if ((fchmod(file.fd, string_to_permissions(file.perms.c_str()).st_mode & 07777) != 0 || futimens(file.fd, times) != 0) && !failed) {
+                    error = fmt::format("failed to set the permissions or time of file: {}", file.path);
+                    failed = true;
+                }
+            }
+            close_fd(file.fd);
+#endif
+            if (file_copied[f] && !file.complete) {
+                // another join may write the rest of it before this one ends
+                split_unfinished.emplace_back(std::move(file));
+            }
+        }
+        if (!split_state.empty() && batch.first_split != UINT64_MAX) {
+            // the last split may go on in the next batch
+            uint64_t below = batch.last_split;
+            for (size_t i = 0; failed && i < batch.pieces.size(); i++) {
+                if (!copied[i]) {
+                    below = std::min(below, batch.pieces[i].split);
+                }
+            }
+            split_copied = std::max(split_copied, below);
+        }
+        if (failed) {
+            fmt::print("{}\n", error);
+        }
+        else if (remove_files && split_state.empty() && batch.first_split != UINT64_MAX) {
+            for (uint64_t split = batch.first_split; split < batch.last_split || (last && split == batch.last_split); split++) {
+                remove_split(layout, split_base, split);
+            }
+        }
+        uint64_t keep = last || batch.first_split == UINT64_MAX ? UINT64_MAX : batch.last_split;
+        batch = {};
+        batch.first_split = keep;
+        batch.last_split = keep == UINT64_MAX ? 0 : keep;
+        return !failed;
+    }
 
-// the path converter is done, any path is now converted into a path relative to .
-//
-// [root]  ..       > .
-// [child] ../foo   > foo
-// [child] ../foo/a > foo/a
-// [root]  ../dir   > .
-// [child] ../dir/a > a
-// [root]  /        > .
-// [child] /a/f/g   > a/f/g
-// [root]  /a/      > .
-// [child] /a/f/g   > f/g
-//
-struct PathRecorder {
-    std::string trim = {};
-    BinWriter w = {};
-    BinReader r = {};
-    uint64_t unknowns = 0;
-
-    struct ChunkInfo {
-        uintmax_t split = 0;
-        uintmax_t offset = 0;
-        uintmax_t length = 0;
-    };
-
-    struct DirInfo {
-        std::filesystem::path path;
-        std::string perms;
-        std::filesystem::file_time_type::rep write_time;
-    };
-    struct FileInfo {
-        std::filesystem::path path;
-        std::string perms;
-        std::filesystem::file_time_type::rep write_time;
-        uintmax_t file_size;
-        std::vector<ChunkInfo> file_chunks;
-    };
-    
-    struct SymlinkInfo {
-        std::filesystem::path path;
-        std::filesystem::path dest;
-    };
-
-    std::vector<DirInfo> bird_is_the_word_d = {};
-    std::vector<FileInfo> bird_is_the_word_f = {};
-    std::vector<SymlinkInfo> bird_is_the_word_s = {};
-
-    int split_number = 0;
-    bool first_split = true;
-    bool open = false;
-    uintmax_t current_chunk_size = 0;
-    uintmax_t chunk_size = SPLIT_SIZE;
-    uintmax_t total_chunk_count = 0;
-    uintmax_t max_file_chunks = 0;
-    uintmax_t total = 0;
-    uintmax_t totalc = 0;
+    int _init_layout() {
+        layout.prefix = SPLIT_PREFIX;
+        layout.fanout = SPLIT_FANOUT;
+        layout.dirs = SPLIT_OUT_DIRS;
+        current_split_dirs.resize(std::max<size_t>(layout.dirs.size(), 1));
+        if (dry_run) {
+            return 0;
+        }
+        for (auto& dir : layout.dirs) {
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            if (ec) {
+                fmt::print("failed to create directory: {}\n", dir);
+                return -1;
+            }
+        }
+        // a single directory gains nothing from a background writer
+        if (layout.dirs.size() > 1) {
+            for (size_t i = 0; i < layout.dirs.size(); i++) {
+                writers.emplace_back(new SplitWriter());
+                writers.back()->start();
+            }
+        }
+        return 0;
+    }
 
-    std::string max_path = {};
-    uint64_t max_perms = 0;
-    std::string max_perms_str = {};
-    uintmax_t max_size = 0;
-    uintmax_t max_chunk = 0;
-    FILE* current_split_file = nullptr;
+    uint16_t _pick_dir() {
+        if (!SPLIT_OUT_BY_SPACE) {
+            return (uint16_t)(split_number % layout.dirs.size());
+        }
+        uint16_t best = 0;
+        uintmax_t best_avail = 0;
+        for (size_t i = 0; i < layout.dirs.size(); i++) {
+            std::error_code ec;
+            uintmax_t avail = std::filesystem::space(layout.dirs[i], ec).available;
+            if (ec) continue;
+            // account for data still queued for this directory
+            uintmax_t queued = writers.empty() ? 0 : writers[i]->pending();
+            avail = avail > queued ? avail - queued : 0;
+            if (avail > best_avail) {
+                best_avail = avail;
+                best = (uint16_t)i;
+            }
+        }
+        return best;
+    }
 
     int _open() {
         if (!open) {
@@ -482,16 +2988,35 @@ struct PathRecorder {
             else {
                 split_number++;
             }
+            uint16_t dir = 0;
+            if (!layout.dirs.empty()) {
+                dir = _pick_dir();
+                layout.split_dirs.emplace_back(dir);
+            }
+            std::string split_f = layout.locate("", split_number);
             if (dry_run) {
-                fmt::print("open {}split.{}\n", SPLIT_PREFIX, split_number);
+                fmt::print("open {}\n", split_f);
             }
             else {
-                std::string split_f = fmt::format("{}split.{}", SPLIT_PREFIX, split_number);
+                if (SPLIT_FANOUT != 0) {
+                    // only touch the directory when we cross into a new one
+                    auto split_dir = std::filesystem::path(split_f).parent_path();
+                    if (split_dir != current_split_dirs[dir]) {
+                        std::error_code ec;
+                        std::filesystem::create_directories(split_dir, ec);
+                        if (ec) {
+                            fmt::print("failed to create directory: {}\n", split_dir);
+                            return -1;
+                        }
+                        current_split_dirs[dir] = split_dir;
+                    }
+                }
                 current_split_file = fopen(split_f.c_str(), "wb");
                 if (current_split_file == nullptr) {
                     fmt::print("failed to create file: {}\n", split_f);
                     return -1;
                 }
+                current_writer = writers.empty() ? nullptr : writers[dir].get();
             }
             open = true;
         }
@@ -501,17 +3026,142 @@ struct PathRecorder {
     void _close() {
         if (open) {
             if (dry_run) {
-                fmt::print("close {}split.{}\n", SPLIT_PREFIX, split_number);
+                fmt::print("close {}\n", layout.locate("", split_number));
             }
             else {
-                fflush(current_split_file);
-                fclose(current_split_file);
+                if (current_writer != nullptr) {
+                    current_writer->close(current_split_file);
+                    current_writer = nullptr;
+                }
+                else {
+                    fflush(current_split_file);
+                    fclose(current_split_file);
+                }
                 current_split_file = nullptr;
             }
             open = false;
         }
     }
 
+    // waits for the background writers, returns -1 if any split failed to write
+    int _finish() {
+        int ret = 0;
+        for (size_t i = 0; i < writers.size(); i++) {
+            if (!writers[i]->stop()) {
+                fmt::print("failed to write splits to directory: {}\n", layout.dirs[i]);
+                ret = -1;
+            }
+        }
+        writers.clear();
+        return ret;
+    }
+
+    // copies length bytes from f into the current split, returns the number of bytes read
+    //
+    // if pad is true a short read is padded with zeros so the split keeps the
+    // layout recorded in the map, otherwise copying stops at the short read
+    //
+    uintmax_t _write(FILE* f, uintmax_t length, bool pad = true) {
+        uintmax_t read = 0;
+        while (length != 0) {
+            size_t block = (size_t)std::min(length, IO_BLOCK);
+            void* buffer = malloc(block);
+            if (buffer == nullptr) {
+                throw std::bad_alloc();
+            }
+            size_t n = fread(buffer, 1, block, f);
+            read += n;
+            if (n != block) {
+                if (pad) {
+                    memset((char*)buffer + n, 0, block - n);
+                }
+                else {
+                    block = n;
+                    length = block;
+                }
+            }
+            if (dry_run || block == 0) {
+                free(buffer);
+            }
+            else if (current_writer != nullptr) {
+                current_writer->write(current_split_file, buffer, block);
+            }
+            else {
+                fwrite(buffer, 1, block, current_split_file);
+                free(buffer);
+            }
+            length -= block;
+        }
+        return read;
+    }
+
+    // records stdin as a single file of unknown length
+    //
+    // splits are filled as data arrives, the size and chunks are known at EOF
+    //
+    int recordStream(const std::string& name) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        if (verbose_files) fmt::print("packing stream: {}\n", name);
+        std::vector<ChunkInfo> file_chunks;
+        uintmax_t s = 0;
+        while (true) {
+            // do not open a split we have nothing to put in
+            int c = fgetc(stdin);
+            if (c == EOF) {
+                break;
+            }
+            ungetc(c, stdin);
+            if (_open() == -1) return -1;
+            uintmax_t avail = chunk_size - current_chunk_size;
+            if (avail == 0) {
+                _close();
+                if (_open() == -1) return -1;
+                current_chunk_size = 0;
+                avail = chunk_size;
+            }
+            ChunkInfo chunk;
+            chunk.split = split_number;
+            chunk.offset = current_chunk_size;
+            chunk.length = _write(stdin, avail, false);
+            if (dry_run) {
+                fmt::print("writing {} bytes\n", chunk.length);
+            }
+            current_chunk_size += chunk.length;
+            totalc += chunk.length;
+            s += chunk.length;
+            file_chunks.emplace_back(chunk);
+            if (chunk.length != avail) {
+                break;
+            }
+        }
+        if (ferror(stdin)) {
+            fmt::print("failed to read stdin\n");
+            _close();
+            return -1;
+        }
+        _close();
+        total += s;
+        total_chunk_count += file_chunks.size();
+        struct stat st = {};
+        st.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        max_path = name;
+        max_size = s;
+        max_chunk = file_chunks.size();
+        max_perms = st.st_mode;
+        max_perms_str = permissions_to_string(st);
+        FileInfo file_info;
+        file_info.path = name;
+        file_info.perms = max_perms_str;
+        file_info.mode = (uint16_t)st.st_mode;
+        file_info.write_time = std::filesystem::file_time_type::clock::now().time_since_epoch().count();
+        file_info.file_size = s;
+        file_info.file_chunks = std::move(file_chunks);
+        bird_is_the_word_f.emplace_back(std::move(file_info));
+        return 0;
+    }
+
     int recordPath(const std::filesystem::path& path) {
         struct stat st;
         if (!get_stats(path, st)) {
@@ -522,6 +3172,7 @@ struct PathRecorder {
             DirInfo di;
             di.path = path;
             di.perms = permissions_to_string(st);
+            di.mode = (uint16_t)st.st_mode;
             di.write_time = std::filesystem::last_write_time(path).time_since_epoch().count();
             bird_is_the_word_d.emplace_back(di);
         }
@@ -579,13 +3230,7 @@ struct PathRecorder {
                     fmt::print("free()\n");
                 }
                 else {
-                    void* buffer = malloc(chunk.length);
-                    if (buffer == nullptr) {
-                        throw std::bad_alloc();
-                    }
-                    fread(buffer, 1, chunk.length, f);
-                    fwrite(buffer, 1, chunk.length, current_split_file);
-                    free(buffer);
+                    _write(f, chunk.length);
                 }
                 file_chunks.emplace_back(chunk);
             }
@@ -623,6 +3268,7 @@ struct PathRecorder {
             FileInfo file_info;
             file_info.path = path;
             file_info.perms = permissions_to_string(st);
+            file_info.mode = (uint16_t)st.st_mode;
             file_info.write_time = file_time;
             file_info.file_size = current_file_size;
             file_info.file_chunks = std::move(file_chunks);
@@ -669,9 +3315,12 @@ struct PathRecorder {
             auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
             fmt::print("recording directory: {} {}   ({: >{}} chunks)   {}\n", dirInfo.perms, s, 0, mfc, dir);
         }
-        w.write_string(&s[trim.length()]);
-        w.write_string(dirInfo.perms.c_str());
-        w.write_u64(dirInfo.write_time);
+        if (w.version >= 2) {
+            index_entries.push_back({dir, INDEX_DIR, w.tell()});
+        }
+        w.write_path(dir);
+        w.write_perms(dirInfo.perms, dirInfo.mode);
+        w.write_time(dirInfo.write_time);
     }
 
     void recordPathFile(const FileInfo & fileInfo, const size_t& mfc) {
@@ -684,9 +3333,26 @@ struct PathRecorder {
             auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
             fmt::print("recording file:      {} {}   ({: >{}} chunks)   {}\n", fileInfo.perms, s, file_chunks, mfc, file);
         }
-        w.write_string(file);
-        w.write_string(fileInfo.perms.c_str());
-        w.write_u64(fileInfo.write_time);
+        if (w.version >= 2) {
+            index_entries.push_back({file, INDEX_FILE, w.tell()});
+        }
+        w.write_path(file);
+        w.write_perms(fileInfo.perms, fileInfo.mode);
+        w.write_time(fileInfo.write_time);
+        if (w.version >= 2) {
+            // the chunks are contiguous, store where they start and the
+            // reader follows them on from there
+            uint64_t length = 0;
+            for (const ChunkInfo& chunk : fileInfo.file_chunks) {
+                length += chunk.length;
+            }
+            w.write_u64(length);
+            if (length != 0) {
+                w.write_u64(fileInfo.file_chunks.front().split);
+                w.write_u64(fileInfo.file_chunks.front().offset);
+            }
+            return;
+        }
         w.write_u64(fileInfo.file_size);
         w.write_u64(file_chunks);
         for (const ChunkInfo& chunk : fileInfo.file_chunks) {
@@ -696,18 +3362,412 @@ struct PathRecorder {
         }
     }
 
-    void recordPathSymlink(const SymlinkInfo& symlinkInfo, const size_t& mfc) {
-        auto s = symlinkInfo.path.string();
-        const char* symlink = &s[trim.length()];
-
-        if (verbose_files) {
-            auto sz = 0;
-            auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
-            fmt::print("recording symlink:   {} {}   ({: >{}} chunks)   {} -> {}\n", "lrwxrwxrwx", 0, s, mfc, symlink, symlinkInfo.dest);
+    void recordPathSymlink(const SymlinkInfo& symlinkInfo, const size_t& mfc) {
+        auto s = symlinkInfo.path.string();
+        const char* symlink = &s[trim.length()];
+
+        if (verbose_files) {
+            auto sz = 0;
+            auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
+            fmt::print("recording symlink:   {} {}   ({: >{}} chunks)   {} -> {}\n", "lrwxrwxrwx", 0, s, mfc, symlink, symlinkInfo.dest);
+        }
+        if (w.version >= 2) {
+            index_entries.push_back({symlink, INDEX_SYMLINK, w.tell()});
+        }
+        w.write_path(symlink);
+        w.write_string_ref(symlinkInfo.dest.string());
+    }
+
+    // starts a new block every MAP_BLOCK_ENTRIES entries of a section
+    void recordBlock(std::vector<MapBlock>& section, uint64_t entry) {
+        if (w.version >= 2 && entry % MAP_BLOCK_ENTRIES == 0) {
+            section.push_back({w.tell(), entry});
+            w.reset_paths();
+        }
+    }
+
+    // writes the path index, bloom filter and toc that follow the symlinks
+    void recordIndex(MapToc& toc) {
+        std::sort(index_entries.begin(), index_entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+            return path_less(a.path, b.path);
+        });
+        // everything below a directory directly follows it, count it
+        std::vector<size_t> open_dirs;
+        for (size_t i = 0; i <= index_entries.size(); i++) {
+            while (!open_dirs.empty()) {
+                size_t d = open_dirs.back();
+                if (i != index_entries.size()) {
+                    const std::string& dir = index_entries[d].path;
+                    const std::string& p = index_entries[i].path;
+                    if (p.size() > dir.size() && p[dir.size()] == '/' && p.compare(0, dir.size(), dir) == 0) {
+                        break;
+                    }
+                }
+                index_entries[d].subtree = i - d - 1;
+                open_dirs.pop_back();
+            }
+            if (i != index_entries.size() && index_entries[i].kind == INDEX_DIR) {
+                open_dirs.push_back(i);
+            }
+        }
+
+        PathBloom bloom;
+        bloom.init(index_entries.size());
+        std::vector<uint64_t> restarts;
+        toc.index = w.tell();
+        w.write_u64(index_entries.size());
+        for (size_t i = 0; i < index_entries.size(); i++) {
+            const IndexEntry& e = index_entries[i];
+            if (i % MAP_INDEX_RESTART == 0) {
+                restarts.push_back(w.tell());
+                w.reset_paths();
+            }
+            w.write_path(e.path.c_str());
+            w.write_u8(e.kind);
+            w.write_u64(e.offset);
+            w.write_u64(e.subtree);
+            bloom.add(e.path);
+        }
+        toc.restarts = w.tell();
+        w.write_u64(restarts.size());
+        for (uint64_t restart : restarts) {
+            w.write_u64(restart);
+        }
+        toc.bloom = w.tell();
+        w.write_u64(bloom.bits.size());
+        w.write_u8(bloom.hashes);
+        w.write_raw(bloom.bits.data(), bloom.bits.size());
+        toc.blocks = w.tell();
+        for (auto* section : {&blocks.dirs, &blocks.files, &blocks.symlinks}) {
+            w.write_u64(section->size());
+            for (auto& block : *section) {
+                w.write_u64(block.offset);
+                w.write_u64(block.first);
+            }
+        }
+        if (w.summary) {
+            toc.summary = w.tell();
+            w.write_u64(summary.sizes.size());
+            for (auto& bucket : summary.sizes) {
+                w.write_u64(bucket.files);
+                w.write_u64(bucket.bytes);
+            }
+            w.write_u64(summary.top.size());
+            for (auto& entry : summary.top) {
+                w.write_string(entry.name.c_str());
+                w.write_u64(entry.dirs);
+                w.write_u64(entry.files);
+                w.write_u64(entry.symlinks);
+                w.write_u64(entry.bytes);
+            }
+            w.write_u64(summary.splits.size());
+            for (auto& split : summary.splits) {
+                w.write_u64(split.bytes);
+                w.write_u64(split.chunks);
+            }
+        }
+        uint64_t toc_offset = w.tell();
+        w.write_u64(toc.dirs);
+        w.write_u64(toc.files);
+        w.write_u64(toc.symlinks);
+        w.write_u64(toc.index);
+        w.write_u64(toc.restarts);
+        w.write_u64(toc.bloom);
+        w.write_u64(toc.blocks);
+        if (w.summary) {
+            w.write_u64(toc.summary);
+        }
+        w.write_raw(&toc_offset, 8);
+        w.write_raw(MAP_TRAILER, 8);
+    }
+
+    // writes the layout, header and sections of the map opened in w
+    bool recordMap() {
+        // in version 1 these fields are optional and identified by their type,
+        // flat maps omit them so they remain readable by older versions
+        if (w.version >= 2 || SPLIT_FANOUT != 0) {
+            w.write_u8(SPLIT_FANOUT);
+        }
+        if (w.version >= 2 || !layout.dirs.empty()) {
+            w.write_u16((uint16_t)layout.dirs.size());
+            for (auto& dir : layout.dirs) {
+                w.write_string(dir.c_str());
+            }
+            w.write_u64(layout.split_dirs.size());
+            for (auto dir : layout.split_dirs) {
+                w.write_u16(dir);
+            }
+        }
+        w.write_u64(SPLIT_SIZE);
+        w.write_string(SPLIT_PREFIX.c_str());
+        w.write_u64(bird_is_the_word_d.size());
+        w.write_u64(bird_is_the_word_f.size());
+        uint64_t chunks = 0;
+        for (auto& f : bird_is_the_word_f) {
+            chunks += f.file_chunks.size();
+        }
+        w.write_u64(chunks);
+        w.write_u64(max_file_chunks);
+        w.write_u64(split_number);
+        w.write_string(max_path.c_str());
+        w.write_perms(max_perms_str, (uint16_t)max_perms);
+        w.write_u64(max_size);
+        w.write_u64(max_chunk);
+        size_t mfc = fmt::formatted_size("{}", max_file_chunks);
+        w.write_u64(bird_is_the_word_s.size());
+        {
+            // times are stored relative to the oldest one
+            int64_t base = INT64_MAX;
+            for (auto& d : bird_is_the_word_d) base = std::min<int64_t>(base, d.write_time);
+            for (auto& f : bird_is_the_word_f) base = std::min<int64_t>(base, f.write_time);
+            w.write_time_base(base == INT64_MAX ? 0 : base);
+        }
+        if (w.sharded) {
+            w.write_u64(shards.size());
+            for (auto& shard : shards) {
+                w.write_string(shard.key.c_str());
+                w.write_u64(shard.first_split == UINT64_MAX ? 0 : shard.first_split + 1);
+                w.write_u64(shard.dirs);
+                w.write_u64(shard.files);
+                w.write_u64(shard.symlinks);
+            }
+        }
+        MapToc toc;
+        blocks = {};
+        toc.dirs = w.tell();
+        w.reset_paths();
+        for (size_t i = 0; i < bird_is_the_word_d.size(); i++) {
+            recordBlock(blocks.dirs, i);
+            recordPathDirectory(bird_is_the_word_d[i], mfc);
+        }
+        toc.files = w.tell();
+        w.reset_paths();
+        for (size_t i = 0; i < bird_is_the_word_f.size(); i++) {
+            recordBlock(blocks.files, i);
+            recordPathFile(bird_is_the_word_f[i], mfc);
+        }
+        toc.symlinks = w.tell();
+        w.reset_paths();
+        {
+            std::vector<std::string> targets;
+            targets.reserve(bird_is_the_word_s.size());
+            for (auto& s : bird_is_the_word_s) {
+                targets.emplace_back(s.dest.string());
+            }
+            w.write_string_table(targets);
+        }
+        for (size_t i = 0; i < bird_is_the_word_s.size(); i++) {
+            recordBlock(blocks.symlinks, i);
+            recordPathSymlink(bird_is_the_word_s[i], mfc);
+        }
+        if (w.version >= 2) {
+            recordIndex(toc);
+        }
+        if (!w.close()) {
+            fmt::print("failed to write split map: {}\n", w.name);
+            return false;
+        }
+        return true;
+    }
+
+    // gathers the statistics of the summary from everything recorded
+    void summarize() {
+        summary = {};
+        std::map<std::string, MapSummary::Entry> top;
+        auto top_of = [&](const std::filesystem::path& path) -> MapSummary::Entry& {
+            auto s = path.string();
+            std::string rel = s.substr(std::min(trim.length(), s.length()));
+            return top[rel.substr(0, rel.find_first_of("/\\"))];
+        };
+        for (auto& d : bird_is_the_word_d) {
+            top_of(d.path).dirs++;
+        }
+        for (auto& f : bird_is_the_word_f) {
+            MapSummary::Entry& entry = top_of(f.path);
+            entry.files++;
+            entry.bytes += f.file_size;
+            size_t bucket = 0;
+            for (uintmax_t size = f.file_size; size != 0; size >>= 1) {
+                bucket++;
+            }
+            if (summary.sizes.size() <= bucket) {
+                summary.sizes.resize(bucket + 1);
+            }
+            summary.sizes[bucket].files++;
+            summary.sizes[bucket].bytes += f.file_size;
+            for (auto& chunk : f.file_chunks) {
+                if (summary.splits.size() <= chunk.split) {
+                    summary.splits.resize(chunk.split + 1);
+                }
+                summary.splits[chunk.split].bytes += chunk.length;
+                summary.splits[chunk.split].chunks++;
+            }
+        }
+        for (auto& sl : bird_is_the_word_s) {
+            top_of(sl.path).symlinks++;
+        }
+        for (auto& entry : top) {
+            entry.second.name = entry.first;
+            summary.top.emplace_back(std::move(entry.second));
+        }
+    }
+
+    // the directory at SHARD_DEPTH that holds a path, empty for paths that
+    // stay in the root map
+    std::string shard_key(const std::filesystem::path& path) {
+        auto s = path.string();
+        std::string rel = s.substr(std::min(trim.length(), s.length()));
+        size_t sep = 0;
+        for (uint16_t i = 0; i < SHARD_DEPTH; i++) {
+            sep = rel.find_first_of("/\\", i == 0 ? 0 : sep + 1);
+            if (sep == std::string::npos) {
+                return {};
+            }
+        }
+        return rel.substr(0, sep);
+    }
+
+    // writes the root map and one map per shard, the entries are recorded
+    // in packing order so every shard keeps the order of its data
+    int recordShards() {
+        std::vector<DirInfo> all_d = std::move(bird_is_the_word_d);
+        std::vector<FileInfo> all_f = std::move(bird_is_the_word_f);
+        std::vector<SymlinkInfo> all_s = std::move(bird_is_the_word_s);
+        std::vector<std::vector<DirInfo>> shard_d;
+        std::vector<std::vector<FileInfo>> shard_f;
+        std::vector<std::vector<SymlinkInfo>> shard_s;
+        std::unordered_map<std::string, size_t> shard_ids;
+        auto shard_of = [&](const std::filesystem::path& path) -> size_t {
+            std::string key = shard_key(path);
+            if (key.empty()) {
+                return SIZE_MAX;
+            }
+            auto it = shard_ids.find(key);
+            if (it != shard_ids.end()) {
+                return it->second;
+            }
+            shards.push_back({key});
+            shard_d.emplace_back();
+            shard_f.emplace_back();
+            shard_s.emplace_back();
+            shard_ids.emplace(key, shards.size() - 1);
+            return shards.size() - 1;
+        };
+        bird_is_the_word_d.clear();
+        bird_is_the_word_f.clear();
+        bird_is_the_word_s.clear();
+        // files first, their order decides the order of the shards
+        for (auto& f : all_f) {
+            size_t id = shard_of(f.path);
+            if (id == SIZE_MAX) {
+                bird_is_the_word_f.emplace_back(std::move(f));
+                continue;
+            }
+            if (!f.file_chunks.empty() && shards[id].first_split == UINT64_MAX) {
+                shards[id].first_split = f.file_chunks.front().split;
+            }
+            shards[id].files++;
+            shard_f[id].emplace_back(std::move(f));
+        }
+        for (auto& d : all_d) {
+            size_t id = shard_of(d.path);
+            if (id == SIZE_MAX) {
+                bird_is_the_word_d.emplace_back(std::move(d));
+                continue;
+            }
+            shards[id].dirs++;
+            shard_d[id].emplace_back(std::move(d));
+        }
+        for (auto& sl : all_s) {
+            size_t id = shard_of(sl.path);
+            if (id == SIZE_MAX) {
+                bird_is_the_word_s.emplace_back(std::move(sl));
+                continue;
+            }
+            shards[id].symlinks++;
+            shard_s[id].emplace_back(std::move(sl));
+        }
+        std::string root_name = w.name;
+        bool ok = recordMap();
+        for (size_t i = 0; i < shards.size() && ok; i++) {
+            bird_is_the_word_d = std::move(shard_d[i]);
+            bird_is_the_word_f = std::move(shard_f[i]);
+            bird_is_the_word_s = std::move(shard_s[i]);
+            index_entries.clear();
+            w.sharded = false;
+            w.summary = false;
+            w.last_path.clear();
+            w.string_ids.clear();
+            w.create(fmt::format("{}.{}", root_name, i).c_str());
+            w.write_magic();
+            ok = recordMap();
+        }
+        // the summary only needs the counts
+        bird_is_the_word_d = std::move(all_d);
+        bird_is_the_word_f = std::move(all_f);
+        bird_is_the_word_s = std::move(all_s);
+        return ok ? 0 : -1;
+    }
+
+    // records only the paths listed in FILES_FROM instead of walking the root
+    //
+    // paths are relative to the root, the parent directories of each path are
+    // recorded once, ahead of the path, so that --join can create them
+    //
+    int recordList() {
+        std::vector<std::string> paths;
+        if (!read_path_list(FILES_FROM, paths)) {
+            return -1;
+        }
+        std::unordered_set<std::string> seen;
+        for (auto& entry : paths) {
+            std::string rel = std::filesystem::path(entry).lexically_normal().generic_string();
+            while (rel.length() > 2 && rel[0] == '.' && rel[1] == '/') {
+                rel.erase(0, 2);
+            }
+            while (!rel.empty() && rel.back() == '/') {
+                rel.pop_back();
+            }
+            if (rel.empty() || rel == "." || rel[0] == '/' || std::filesystem::path(rel).has_root_name() || rel == ".." || rel.rfind("../", 0) == 0) {
+                fmt::print("skipping path outside of the root: {}\n", entry);
+                continue;
+            }
+            if (!seen.insert(rel).second) {
+                continue;
+            }
+            std::filesystem::path item = trim + rel;
+            if (!path_exists(item)) {
+                fmt::print("item does not exist: {}\n", item);
+                seen.erase(rel);
+                continue;
+            }
+            if (!filter.empty()) {
+                std::error_code ec;
+                bool is_dir = std::filesystem::is_directory(std::filesystem::symlink_status(item, ec));
+                if (filter.excluded(filter.feed(filter.start(), rel), is_dir)) {
+                    if (verbose_files) fmt::print("excluding: {}\n", rel);
+                    continue;
+                }
+            }
+            // record any parents we have not seen yet, outermost first
+            size_t sep = rel.find('/');
+            while (sep != std::string::npos) {
+                std::string dir = rel.substr(0, sep);
+                if (seen.insert(dir).second) {
+                    if (recordPath(trim + dir) == -1) {
+                        return -1;
+                    }
+                    if (!bird_is_the_word_d.empty() && bird_is_the_word_d.back().path == trim + dir) {
+                        bird_is_the_word_d.back().keep = true;
+                    }
+                }
+                sep = rel.find('/', sep + 1);
+            }
+            if (recordPath(item) == -1) {
+                return -1;
+            }
         }
-        w.write_string(symlink);
-        auto s2 = symlinkInfo.dest.string();
-        w.write_string(s2.c_str());
+        return 0;
     }
 
     int record(const char* path) {
@@ -720,12 +3780,31 @@ struct PathRecorder {
             x[4] = '\0';
             return record(x);
         }
+        if (_init_layout() == -1) {
+            return -1;
+        }
+        for (auto& pattern : EXCLUDE_PATTERNS) {
+            filter.add(pattern, false);
+        }
+        for (auto& pattern : INCLUDE_PATTERNS) {
+            filter.add(pattern, true);
+        }
         std::filesystem::path p = std::filesystem::path(path);
 
-        if (::is_symlink(p)) {
+        if (strcmp(path, "-") == 0) {
+            auto split_map_name = fmt::format("{}split.map", SPLIT_PREFIX);
+            w.create(split_map_name.c_str());
+            w.write_magic();
+            trim = "";
+            fmt::print("reading stdin\n");
+            if (recordStream(SPLIT_PREFIX.substr(0, SPLIT_PREFIX.length() - 1)) == -1) {
+                _close();
+                return -1;
+            }
+        } else if (::is_symlink(p)) {
             auto split_map_name = fmt::format("{}split.map", SPLIT_PREFIX);
             w.create(split_map_name.c_str());
-            w.write_string("BIN_WRITR_MGK");
+            w.write_magic();
             {
                 std::filesystem::path copy = p;
                 trim = copy.remove_filename().string();
@@ -739,7 +3818,7 @@ struct PathRecorder {
         } else if (std::filesystem::is_directory(p)) {
             auto split_map_name = fmt::format("{}split.map", SPLIT_PREFIX);
             w.create(split_map_name.c_str());
-            w.write_string("BIN_WRITR_MGK");
+            w.write_magic();
             trim = path;
             if (trim[trim.length()] != '/') {
                 trim += "/";
@@ -747,25 +3826,94 @@ struct PathRecorder {
                 trim += "/";
             }
             fmt::print("entering directory: {}\n", path);
-            std::filesystem::recursive_directory_iterator begin = std::filesystem::recursive_directory_iterator(p);
-            std::filesystem::recursive_directory_iterator end;
-            for (; begin != end; begin++) {
-                auto & fpath = *begin;
-                if (path_exists(fpath)) {
-                    if (recordPath(fpath.path()) == -1) {
-                        _close();
-                        return -1;
-                    }
+            if (!FILES_FROM.empty()) {
+                if (recordList() == -1) {
+                    _close();
+                    return -1;
                 }
-                else {
-                    fmt::print("item does not exist: {}\n", fpath.path());
+                _close();
+            }
+            else {
+                // when sharding, a first pass packs the files above SHARD_DEPTH and
+                // the second pass everything else, the walk is depth first so the
+                // data of each shard ends up contiguous and in shard order
+                for (int pass = SHARD_DEPTH != 0 ? 0 : 1; pass < 2; pass++) {
+                    bool shallow = pass == 0;
+                    std::filesystem::recursive_directory_iterator begin = std::filesystem::recursive_directory_iterator(p);
+                    std::filesystem::recursive_directory_iterator end;
+                    // the matcher state after each parent directory, and parents that were
+                    // excluded but may still hold included items, recorded once one shows up
+                    std::vector<int> states;
+                    std::vector<std::filesystem::path> pending;
+                    if (!filter.empty()) {
+                        states.emplace_back(filter.start());
+                    }
+                    for (; begin != end; begin++) {
+                        auto & fpath = *begin;
+                        size_t depth = (size_t)begin.depth();
+                        // the type comes from the directory listing, no stat is needed
+                        std::error_code ec;
+                        bool is_dir = !fpath.is_symlink(ec) && fpath.is_directory(ec);
+                        if (!filter.empty()) {
+                            states.resize(depth + 1);
+                            pending.resize(depth + 1);
+                            pending[depth].clear();
+                            int state = filter.feed(states[depth], fpath.path().filename().string());
+                            if (is_dir) {
+                                states.emplace_back(filter.feed(state, '/'));
+                            }
+                            if (filter.excluded(state, is_dir)) {
+                                if (is_dir && filter.include_alive(states.back())) {
+                                    pending[depth] = fpath.path();
+                                }
+                                else {
+                                    if (verbose_files) fmt::print("excluding: {}\n", fpath.path());
+                                    if (is_dir) {
+                                        begin.disable_recursion_pending();
+                                    }
+                                }
+                                continue;
+                            }
+                            for (size_t i = 0; i < depth && !shallow; i++) {
+                                if (!pending[i].empty()) {
+                                    if (recordPath(pending[i]) == -1) {
+                                        _close();
+                                        return -1;
+                                    }
+                                    bird_is_the_word_d.back().keep = true;
+                                    pending[i].clear();
+                                }
+                            }
+                        }
+                        if (shallow) {
+                            if (is_dir) {
+                                if (depth + 1 >= SHARD_DEPTH) {
+                                    begin.disable_recursion_pending();
+                                }
+                                continue;
+                            }
+                        }
+                        else if (SHARD_DEPTH != 0 && !is_dir && depth < SHARD_DEPTH) {
+                            // packed by the first pass
+                            continue;
+                        }
+                        if (path_exists(fpath)) {
+                            if (recordPath(fpath.path()) == -1) {
+                                _close();
+                                return -1;
+                            }
+                        }
+                        else {
+                            fmt::print("item does not exist: {}\n", fpath.path());
+                        }
+                    }
                 }
+                _close();
             }
-            _close();
         } else if (std::filesystem::is_regular_file(p)) {
             auto split_map_name = fmt::format("{}split.map", SPLIT_PREFIX);
             w.create(split_map_name.c_str());
-            w.write_string("BIN_WRITR_MGK");
+            w.write_magic();
             {
                 std::filesystem::path copy = p;
                 trim = copy.remove_filename().string();
@@ -782,23 +3930,17 @@ struct PathRecorder {
             w.close();
             return -1;
         }
-        w.write_u64(SPLIT_SIZE);
-        w.write_string(SPLIT_PREFIX.c_str());
-        w.write_u64(bird_is_the_word_d.size());
-        w.write_u64(bird_is_the_word_f.size());
-        w.write_u64(total_chunk_count);
-        w.write_u64(max_file_chunks);
-        w.write_u64(split_number);
-        w.write_string(max_path.c_str());
-        w.write_string(max_perms_str.c_str());
-        w.write_u64(max_size);
-        w.write_u64(max_chunk);
-        size_t mfc = fmt::formatted_size("{}", max_file_chunks);
-        w.write_u64(bird_is_the_word_s.size());
+        if (_finish() == -1) {
+            w.close();
+            return -1;
+        }
         if (remove_files) {
             auto copy = bird_is_the_word_d;
             std::reverse(copy.begin(), copy.end());
             for (auto& d : copy) {
+                if (d.keep) {
+                    continue;
+                }
                 if (dry_run) {
                     auto paths = d.path.string();
                     fmt::print("rmdir {}\n", &paths[trim.length()]);
@@ -814,18 +3956,23 @@ struct PathRecorder {
                 }
             }
         }
-        for (auto& d : bird_is_the_word_d) {
-            recordPathDirectory(d, mfc);
-        }
-        for (auto& f : bird_is_the_word_f) {
-            recordPathFile(f, mfc);
+        summarize();
+        if (SHARD_DEPTH == 0) {
+            if (!recordMap()) {
+                return -1;
+            }
         }
-        for (auto& s : bird_is_the_word_s) {
-            recordPathSymlink(s, mfc);
+        else if (recordShards() == -1) {
+            return -1;
         }
-        w.close();
         fmt::print("split size:           {}\n", SPLIT_SIZE);
         fmt::print("split prefix:         {}\n", SPLIT_PREFIX);
+        if (SPLIT_FANOUT != 0) {
+            fmt::print("split fanout:         {}\n", SPLIT_FANOUT);
+        }
+        for (size_t i = 0; i < layout.dirs.size(); i++) {
+            fmt::print("split directory:      {}\n", layout.dirs[i]);
+        }
         fmt::print("directories recorded: {}\n", bird_is_the_word_d.size());
         fmt::print("files recorded:       {}\n", bird_is_the_word_f.size());
         fmt::print("chunks recorded:      {}\n", total_chunk_count);
@@ -844,7 +3991,7 @@ struct PathRecorder {
         }
         auto sz = max_size;
         auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
-        fmt::print("largest file: {: >{}}         {} {}   ({: >{}} chunks)   {}\n", "", fmt::formatted_size("{}", std::max(bird_is_the_word_f.size(), total_chunk_count)), max_perms_str, s, max_chunk, mfc, max_path);
+        fmt::print("largest file: {: >{}}         {} {}   ({: >{}} chunks)   {}\n", "", fmt::formatted_size("{}", std::max(bird_is_the_word_f.size(), total_chunk_count)), max_perms_str, s, max_chunk, fmt::formatted_size("{}", max_file_chunks), max_path);
         return 0;
     }
 
@@ -980,11 +4127,146 @@ struct PathRecorder {
         return r;
     }
 
+    // reads the optional fields that follow the magic
+    void read_layout(SplitLayout& layout) {
+        if (r.version >= 2) {
+            layout.fanout = r.read_u8();
+            uint16_t dirs = r.read_u16();
+            for (uint16_t i = 0; i < dirs; i++) {
+                layout.dirs.emplace_back(r.read_view());
+            }
+            uint64_t splits = r.read_u64();
+            layout.split_dirs.reserve(splits);
+            for (uint64_t i = 0; i < splits; i++) {
+                uint16_t dir = r.read_u16();
+                if (dir >= layout.dirs.size()) {
+                    throw std::runtime_error("split directory out of range");
+                }
+                layout.split_dirs.emplace_back(dir);
+            }
+            return;
+        }
+        if (r.peek_type() == BinWriter::U8) {
+            layout.fanout = r.read_u8();
+        }
+        if (r.peek_type() == BinWriter::U16) {
+            uint16_t dirs = r.read_u16();
+            for (uint16_t i = 0; i < dirs; i++) {
+                layout.dirs.emplace_back(r.read_view());
+            }
+            uint64_t splits = r.read_u64();
+            layout.split_dirs.reserve(splits);
+            for (uint64_t i = 0; i < splits; i++) {
+                uint16_t dir = r.read_u16();
+                if (dir >= layout.dirs.size()) {
+                    throw std::runtime_error("split directory out of range");
+                }
+                layout.split_dirs.emplace_back(dir);
+            }
+        }
+    }
+
+    // lists the entries of a section on all cores, each block is decoded into
+    // its own buffer by a reader sharing the map and the buffers are printed
+    // in block order
+    void list_blocks(const std::vector<MapBlock>& section, uint64_t count, INDEX_KIND kind, const SplitLayout& layout, bool list_chunks, size_t mfc, uintmax_t& total, uintmax_t& totalc) {
+        size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        size_t batch = threads * 4;
+        std::vector<std::string> out(batch);
+        std::vector<uintmax_t> totals(batch);
+        std::vector<uintmax_t> totalcs(batch);
+        for (size_t b = 0; b < section.size(); b += batch) {
+            size_t n = std::min(batch, section.size() - b);
+            std::atomic<size_t> next(0);
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            auto work = [&]() {
+                try {
+                    BinReader in;
+                    in.share(r);
+                    for (size_t i = next++; i < n; i = next++) {
+                        const MapBlock& block = section[b + i];
+                        uint64_t end = b + i + 1 < section.size() ? section[b + i + 1].first : count;
+                        auto it = std::back_inserter(out[i]);
+                        in.seek(block.offset);
+                        in.reset_paths();
+                        for (uint64_t e = block.first; e < end; e++) {
+                            const char* path = in.read_path();
+                            if (kind == INDEX_SYMLINK) {
+                                std::string_view dest = in.read_string_ref();
+                                fmt::format_to(it, "{} {: >8}   ({: >{}} chunks)   {} -> {}\n", "lrwxrwxrwx", 0, 0, mfc, path, dest);
+                                continue;
+                            }
+                            const char* perms = in.read_perms();
+                            in.read_time();
+                            if (kind == INDEX_DIR) {
+                                fmt::format_to(it, "{} {: >8}   ({: >{}} chunks)   {}\n", perms, 0, 0, mfc, path);
+                                continue;
+                            }
+                            uint64_t file_size = in.read_u64();
+                            ChunkCursor cursor = read_chunks(in, file_size);
+                            totals[i] += file_size;
+                            fmt::format_to(it, "{} {: >8}   ({: >{}} chunks)   {}\n", perms, file_size, cursor.count, mfc, path);
+                            for (uintmax_t c = 0; c < cursor.count; c++) {
+                                ChunkInfo chunk = cursor.next();
+                                if (list_chunks) {
+                                    fmt::format_to(it, "   [chunk] {} [{: >{}}-{: >{}}]\n", layout.locate("", chunk.split), chunk.offset, fmt::formatted_size("{}", SPLIT_SIZE), chunk.offset + chunk.length, fmt::formatted_size("{}", SPLIT_SIZE));
+                                }
+                                totalcs[i] += chunk.length;
+                            }
+                        }
+                    }
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    error = std::current_exception();
+                }
+            };
+            std::vector<std::thread> pool;
+            for (size_t t = 1; t < std::min(threads, n); t++) {
+                pool.emplace_back(work);
+            }
+            work();
+            for (auto& thread : pool) {
+                thread.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            for (size_t i = 0; i < n; i++) {
+                fwrite(out[i].data(), 1, out[i].size(), stdout);
+                out[i].clear();
+                total += totals[i];
+                totalc += totalcs[i];
+                totals[i] = 0;
+                totalcs[i] = 0;
+            }
+        }
+    }
+
+    // reads the shard table of a root map, shard maps leave it untouched
+    void read_shards() {
+        if ((r.flags & MAP_FLAG_SHARDED) == 0) {
+            return;
+        }
+        shards.resize(r.read_u64());
+        for (auto& shard : shards) {
+            shard.key = r.read_view();
+            uint64_t first_split = r.read_u64();
+            shard.first_split = first_split == 0 ? UINT64_MAX : first_split - 1;
+            shard.dirs = r.read_u64();
+            shard.files = r.read_u64();
+            shard.symlinks = r.read_u64();
+        }
+        // the root map leaves the split it shares with the first shard
+        keep_split_from = next_shard_split(0);
+    }
+
     int playback_url(const char* url, bool join_files, bool list_chunks) {
         if (!join_files) {
             remove_files = true; // remove temporary downloaded temporary files if we are not joining them
         }
-        if (join_files) {
+        if (join_files && !joining_shard) {
             if (path_exists(out_directory)) {
                 if (!dry_run) {
                     if (!std::filesystem::is_directory(out_directory)) {
@@ -993,7 +4275,8 @@ struct PathRecorder {
                     }
                     std::filesystem::directory_iterator begin = std::filesystem::directory_iterator(out_directory);
                     std::filesystem::directory_iterator end;
-                    for (; begin != end; begin++) {
+                    // --update refreshes whatever is already there
+                    for (; !JOIN_UPDATE && begin != end; begin++) {
                         auto& fpath = *begin;
                         if (path_exists(fpath)) {
                             fmt::print("cannot output to a non-empty directory: {}\n", out_directory);
@@ -1034,18 +4317,17 @@ struct PathRecorder {
         }
         parent = parent.parent_path();
         r.open(path);
-        const char* str = r.read_string();
-        if (strcmp(str, "BIN_WRITR_MGK") != 0) {
-            std::string e = "invalid magic: ";
-            e += str;
+        std::string e;
+        if (!r.read_magic(e)) {
             fmt::print("{}\n", e);
-            free((void*)str);
             r.close();
             return -1;
         }
-        free((void*)str);
+        SplitLayout layout;
+        read_layout(layout);
         SPLIT_SIZE = r.read_u64();
         const char* SPLIT_PREFIX = r.read_string();
+        layout.prefix = SPLIT_PREFIX;
         uint64_t dirs = r.read_u64();
         uint64_t files = r.read_u64();
         uint64_t chunks = r.read_u64();
@@ -1053,40 +4335,68 @@ struct PathRecorder {
         uint64_t split_number = r.read_u64();
         size_t mfc = fmt::formatted_size("{}", max_file_chunks);
         const char* max_path = r.read_string();
-        const char* max_perms = r.read_string();
+        const char* max_perms = r.read_perms();
         uintmax_t max_size = r.read_u64();
         uintmax_t max_chunk = r.read_u64();
         uint64_t symlinks = r.read_u64();
+        r.read_time_base();
+        read_shards();
+        // a listing decodes the blocks of each section on all cores
+        MapToc toc;
+        MapBlocks map_blocks;
+        bool parallel = !join_files && read_blocks(toc, map_blocks);
         fmt::print("reading {} directories\n", dirs);
+        if (parallel) {
+            uintmax_t unused = 0;
+            list_blocks(map_blocks.dirs, dirs, INDEX_DIR, layout, list_chunks, mfc, unused, unused);
+            dirs = 0;
+        }
         std::vector<std::pair<const char*, std::pair<const char*, std::filesystem::file_time_type::rep>>> dirs_vec;
+        r.reset_paths();
         while (dirs != 0) {
             dirs--;
 
-            const char* dir = r.read_string();
-            const char* dir_perms = r.read_string();
-            std::filesystem::file_time_type::rep t = (std::filesystem::file_time_type::rep)r.read_u64();
+            const char* dir = r.read_path();
+            const char* dir_perms = r.read_perms();
+            std::filesystem::file_time_type::rep t = (std::filesystem::file_time_type::rep)r.read_time();
 
             if (join_files) {
+                _keep(dir);
+            }
+            if (join_files && !selected(dir, true)) {
+                continue;
+            }
+            if (join_files && !make_parents(dir)) {
+                r.close();
+                free((void*)SPLIT_PREFIX);
+                free((void*)max_path);
+                return -1;
+            }
+            if (join_files) {
+                if (!only.empty()) {
+                    made_dirs.emplace(dir);
+                }
                 if (dry_run) {
                     fmt::print("mkdir {: >9} {}/{}\n", "", out_directory, dir);
                 }
                 else {
                     if (verbose_files) fmt::print("unpacking directory: {}/{}\n", out_directory, dir);
-                    if (!std::filesystem::create_directory(out_directory + "/" + dir)) {
+                    if (!_join_mkdir(dir)) {
                         fmt::print("failed to create directory: {}/{}\n", out_directory, dir);
                         r.close();
                         free((void*)SPLIT_PREFIX);
                         free((void*)max_path);
-                        free((void*)max_perms);
                         return -1;
                     }
                 }
-                dirs_vec.emplace_back(std::pair<const char*, std::pair<const char*, std::filesystem::file_time_type::rep>>(dir, std::pair<const char*, std::filesystem::file_time_type::rep>(dir_perms, t)));
+                char* dir_copy = strdup(dir);
+                if (dir_copy == nullptr) {
+                    throw std::bad_alloc();
+                }
+                dirs_vec.emplace_back(std::pair<const char*, std::pair<const char*, std::filesystem::file_time_type::rep>>(dir_copy, std::pair<const char*, std::filesystem::file_time_type::rep>(dir_perms, t)));
             }
             else {
                 fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", dir_perms, 0, 0, mfc, dir);
-                free((void*)dir);
-                free((void*)dir_perms);
             }
         }
         fmt::print("reading {} files with a total of {} split files consisting of {} chunks\n", files, split_number+1, chunks);
@@ -1096,19 +4406,46 @@ struct PathRecorder {
         bool split_open = false;
         TempFileFILE * current_tmp_split = nullptr;
 
-        for (uintmax_t i = 0; i < files; i++) {
-            const char* file = r.read_string();
-            const char* file_perms = r.read_string();
-            std::filesystem::file_time_type::rep file_time = (std::filesystem::file_time_type::rep)r.read_u64();
+        uintmax_t first_file = 0;
+        if (parallel) {
+            list_blocks(map_blocks.files, files, INDEX_FILE, layout, list_chunks, mfc, total, totalc);
+            first_file = files;
+            r.seek(toc.symlinks);
+        }
+        r.reset_paths();
+        for (uintmax_t i = first_file; i < files; i++) {
+            const char* file = r.read_path();
+            const char* file_perms = r.read_perms();
+            std::filesystem::file_time_type::rep file_time = (std::filesystem::file_time_type::rep)r.read_time();
             uint64_t file_size = r.read_u64();
-            uint64_t file_chunks = r.read_u64();
+            ChunkCursor cursor = read_chunks(file_size);
+            uint64_t file_chunks = cursor.count;
             total += file_size;
 
+            if (join_files) {
+                _keep(file);
+            }
+            if (join_files && (!selected(file, false) || _join_unchanged(file, file_size, file_time, file_perms))) {
+                // a file left out by --only or unchanged on disk never touches its splits
+                for (uintmax_t i = 0; i < file_chunks; i++) {
+                    cursor.next();
+                }
+                continue;
+            }
+            if (join_files && !make_parents(file)) {
+                delete current_tmp_split;
+                r.close();
+                free((void*)SPLIT_PREFIX);
+                free((void*)max_path);
+                return -1;
+            }
+
             if (join_files) {
                 if (dry_run) {
                     fmt::print("fopen({}/{}, \"wb\")\n", out_directory, file);
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
                         if (split != current_split) {
                             if (split_open) {
                                 fmt::print("fclose({}/split.{}.<TMP_XXXXXX>)\n", parent, current_split);
@@ -1125,15 +4462,14 @@ struct PathRecorder {
                                 throw std::bad_alloc();
                             }
                             strrchr(t, '/')[1] = '\0';
-                            fmt::print("download_url({}{}split.{}) -> {}/split.{}.<TMP_XXXXXX>\n", t, SPLIT_PREFIX, split, parent, split);
+                            fmt::print("download_url({}) -> {}/split.{}.<TMP_XXXXXX>\n", layout.locate(t, split, true), parent, split);
                             free(t);
                             fmt::print("fopen({}/split.{}.<TMP_XXXXXX>, \"rb\")\n", parent, split);
-                            fmt::print("fseek({}/split.{}.<TMP_XXXXXX>, 0)\n", parent, SPLIT_PREFIX, split);
                             split_open = true;
                         }
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
-                        fmt::print("fread({}/split.{}.<TMP_XXXXXX>, buf, {})\n", parent, split, length);
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
+                        fmt::print("pread({}/split.{}.<TMP_XXXXXX>, buf, {}, {})\n", parent, split, length, offset);
                         fmt::print("fwrite({}/{}, buf, {})\n", out_directory, file, length);
                         totalc += length;
                     }
@@ -1151,11 +4487,11 @@ struct PathRecorder {
                         r.close();
                         free((void*)SPLIT_PREFIX);
                         free((void*)max_path);
-                        free((void*)max_perms);
                         return -1;
                     }
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
                         if (split != current_split) {
                             if (split_open) {
                                 if (!remove_files) {
@@ -1178,7 +4514,7 @@ struct PathRecorder {
                             strrchr(t, '/')[1] = '\0';
                             current_tmp_split = new TempFileFILE();
                             current_tmp_split->construct(TempFile::TempDir(), fmt::format("split.{}.", split), TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE | TEMP_FILE_OPEN_MODE_BINARY, !remove_files);
-                            std::string out_url = fmt::format("{}{}split.{}", t, SPLIT_PREFIX, split);
+                            std::string out_url = layout.locate(t, split, true);
                             fmt::print("downloading item: {}\n", out_url);
                             auto in_s = current_tmp_split->get_path();
                             fmt::print("-> path: {}\n", in_s);
@@ -1191,7 +4527,6 @@ struct PathRecorder {
                                 r.close();
                                 free((void*)SPLIT_PREFIX);
                                 free((void*)max_path);
-                                free((void*)max_perms);
                                 return -1;
                             }
                             fmt::print("downloaded item: {}\n", out_url);
@@ -1199,18 +4534,20 @@ struct PathRecorder {
                             fflush(stdout);
                             fflush(stderr);
                             free(t);
-                            fseek(current_tmp_split->get_handle(), 0, SEEK_SET);
                             split_open = true;
                         }
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
-                        void* buffer = malloc(length);
-                        if (buffer == nullptr) {
-                            throw std::bad_alloc();
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
+                        if (!_copy_chunk(fileno(current_tmp_split->get_handle()), offset, f, length)) {
+                            fmt::print("failed to copy {} bytes from split {} to file: {}\n", length, split, out_f);
+                            delete current_tmp_split;
+                            current_tmp_split = nullptr;
+                            fclose(f);
+                            r.close();
+                            free((void*)SPLIT_PREFIX);
+                            free((void*)max_path);
+                            return -1;
                         }
-                        fread(buffer, 1, length, current_tmp_split->get_handle());
-                        fwrite(buffer, 1, length, f);
-                        free(buffer);
                         totalc += length;
                     }
                     fflush(f);
@@ -1224,26 +4561,26 @@ struct PathRecorder {
                 if (list_chunks) {
                     fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", file_perms, file_size, file_chunks, mfc, file);
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
-                        fmt::print("   [chunk] {}split.{} [{: >{}}-{: >{}}]\n", SPLIT_PREFIX, split, offset, fmt::formatted_size("{}", SPLIT_SIZE), offset + length, fmt::formatted_size("{}", SPLIT_SIZE));
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
+                        fmt::print("   [chunk] {} [{: >{}}-{: >{}}]\n", layout.locate("", split), offset, fmt::formatted_size("{}", SPLIT_SIZE), offset + length, fmt::formatted_size("{}", SPLIT_SIZE));
                         totalc += length;
                     }
                 }
                 else {
                     fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", file_perms, file_size, file_chunks, mfc, file);
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
                         totalc += length;
                     }
                 }
             }
 
-            free((void*)file);
-            free((void*)file_perms);
         }
         if (join_files) {
             if (split_open) {
@@ -1282,12 +4619,33 @@ struct PathRecorder {
         auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
         fmt::print("largest file: {: >{}}         {} {}   ({: >{}} chunks)   {}\n", "", fmt::formatted_size("{}", std::max(files, chunks)), max_perms, s, max_chunk, mfc, max_path);
         fmt::print("reading {} symlinks\n", symlinks);
+        r.reset_paths();
+        r.read_string_table();
+        if (parallel) {
+            list_blocks(map_blocks.symlinks, symlinks, INDEX_SYMLINK, layout, list_chunks, mfc, total, totalc);
+            symlinks = 0;
+        }
         while (symlinks != 0) {
             symlinks--;
 
-            const char* symlink = r.read_string();
-            const char* symlink_dest = r.read_string();
+            const char* symlink = r.read_path();
+            std::string_view symlink_dest = r.read_string_ref();
 
+            if (join_files) {
+                _keep(symlink);
+            }
+            if (join_files && !selected(symlink, false)) {
+                continue;
+            }
+            if (join_files && !make_parents(symlink)) {
+                r.close();
+                free((void*)SPLIT_PREFIX);
+                free((void*)max_path);
+                return -1;
+            }
+            if (join_files && _join_same_link(symlink, symlink_dest)) {
+                continue;
+            }
             if (join_files) {
                 if (dry_run) {
                     fmt::print("ln -s {} {}/{}\n", symlink_dest, out_directory, symlink);
@@ -1308,7 +4666,6 @@ struct PathRecorder {
                     //    r.close();
                     //    free((void*)SPLIT_PREFIX);
                     //    free((void*)max_path);
-                    //    free((void*)max_perms);
                     //    return -1;
                     //}
                     //auto parent = sp;
@@ -1317,7 +4674,6 @@ struct PathRecorder {
                     //    r.close();
                     //    free((void*)SPLIT_PREFIX);
                     //    free((void*)max_path);
-                    //    free((void*)max_perms);
                     //    return -1;
                     //}
                     //parent = parent.parent_path();
@@ -1343,12 +4699,14 @@ struct PathRecorder {
             else {
                 fmt::print("{} {: >8}   ({: >{}} chunks)   {} -> {}\n", "lrwxrwxrwx", 0, 0, mfc, symlink, symlink_dest);
             }
-            free((void*)symlink);
-            free((void*)symlink_dest);
         }
         if (join_files) {
             for (auto& dirs : dirs_vec) {
-                if (dry_run) {
+                if (defer_dirs) {
+                    // a later shard may still add items to this directory
+                    deferred_dirs.push_back({dirs.first, dirs.second.first, dirs.second.second});
+                }
+                else if (dry_run) {
                     fmt::print("chmod {: >9} {}/{}\n", dirs.second.first, out_directory, dirs.first);
                 }
                 else {
@@ -1356,7 +4714,6 @@ struct PathRecorder {
                     std::filesystem::last_write_time(out_directory + "/" + dirs.first, std::filesystem::file_time_type(std::filesystem::file_time_type::duration(dirs.second.second)));
                 }
                 free((void*)dirs.first);
-                free((void*)dirs.second.first);
             }
         }
         if (!dry_run && !remove_files) {
@@ -1365,11 +4722,53 @@ struct PathRecorder {
         r.close();
         free((void*)SPLIT_PREFIX);
         free((void*)max_path);
-        free((void*)max_perms);
         return 0;
     }
+    void remove_split(const SplitLayout& layout, const std::string& split_base, uint64_t split) {
+        if (split >= keep_split_from) {
+            // the next map of a sharded split map still reads this split
+            return;
+        }
+        auto path_to_remove = layout.locate(split_base, split);
+        try {
+            std::filesystem::remove(path_to_remove);
+        }
+        catch (std::exception& e) {
+            fmt::print("failed to remove path: {}\n", path_to_remove);
+            return;
+        }
+        // remove fan-out directories as they empty out, a non-empty directory stops the walk
+        std::filesystem::path dir = std::filesystem::path(path_to_remove).parent_path();
+        for (uint8_t i = 0; layout.fanout != 0 && i <= layout.fanout; i++) {
+            std::error_code ec;
+            if (!std::filesystem::remove(dir, ec)) {
+                break;
+            }
+            dir = dir.parent_path();
+        }
+    }
+
+    // hints the kernel to start reading the next split when it lives in
+    // another directory, so striped archives read from several devices at once
+    void prefetch_split(const SplitLayout& layout, const std::string& split_base, uint64_t split, uint64_t last_split) {
+#if defined(POSIX_FADV_WILLNEED)
+        if (layout.dirs.size() < 2 || split > last_split || split >= layout.split_dirs.size()) {
+            return;
+        }
+        if (layout.split_dirs[split] == layout.split_dirs[split - 1]) {
+            return;
+        }
+        auto s = layout.locate(split_base, split);
+        int fd = ::open(s.c_str(), O_RDONLY);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            ::close(fd);
+        }
+#endif
+    }
+
     int playback_file(const char * path, bool join_files, bool list_chunks) {
-        if (join_files) {
+        if (join_files && !joining_shard) {
             if (path_exists(out_directory)) {
                 if (!dry_run) {
                     if (!std::filesystem::is_directory(out_directory)) {
@@ -1378,7 +4777,8 @@ struct PathRecorder {
                     }
                     std::filesystem::directory_iterator begin = std::filesystem::directory_iterator(out_directory);
                     std::filesystem::directory_iterator end;
-                    for (; begin != end; begin++) {
+                    // --update refreshes whatever is already there
+                    for (; !JOIN_UPDATE && begin != end; begin++) {
                         auto& fpath = *begin;
                         if (path_exists(fpath)) {
                             fmt::print("cannot output to a non-empty directory: {}\n", out_directory);
@@ -1409,19 +4809,19 @@ struct PathRecorder {
             return -1;
         }
         parent = parent.parent_path();
+        std::string split_base = fmt::format("{}/", parent);
         r.open(path);
-        const char * str = r.read_string();
-        if (strcmp(str, "BIN_WRITR_MGK") != 0) {
-            std::string e = "invalid magic: ";
-            e += str;
+        std::string e;
+        if (!r.read_magic(e)) {
             fmt::print("{}\n", e);
-            free((void*)str);
             r.close();
             return -1;
         }
-        free((void*)str);
+        SplitLayout layout;
+        read_layout(layout);
         SPLIT_SIZE = r.read_u64();
         const char* SPLIT_PREFIX = r.read_string();
+        layout.prefix = SPLIT_PREFIX;
         uint64_t dirs = r.read_u64();
         uint64_t files = r.read_u64();
         uint64_t chunks = r.read_u64();
@@ -1429,40 +4829,77 @@ struct PathRecorder {
         uint64_t split_number = r.read_u64();
         size_t mfc = fmt::formatted_size("{}", max_file_chunks);
         const char* max_path = r.read_string();
-        const char* max_perms = r.read_string();
+        const char* max_perms = r.read_perms();
         uintmax_t max_size = r.read_u64();
         uintmax_t max_chunk = r.read_u64();
         uint64_t symlinks = r.read_u64();
+        r.read_time_base();
+        read_shards();
+        // a listing decodes the blocks of each section on all cores
+        MapToc toc;
+        MapBlocks map_blocks;
+        bool parallel = !join_files && read_blocks(toc, map_blocks);
         fmt::print("reading {} directories\n", dirs);
+        if (parallel) {
+            uintmax_t unused = 0;
+            list_blocks(map_blocks.dirs, dirs, INDEX_DIR, layout, list_chunks, mfc, unused, unused);
+            dirs = 0;
+        }
+#ifndef _WIN32
+        if (join_files && !dry_run && !_join_open_dirs()) {
+            fmt::print("failed to open output directory: {}\n", out_directory);
+            r.close();
+            free((void*)SPLIT_PREFIX);
+            free((void*)max_path);
+            return -1;
+        }
+#endif
         std::vector<std::pair<const char*, std::pair<const char*, std::filesystem::file_time_type::rep>>> dirs_vec;
+        r.reset_paths();
         while (dirs != 0) {
             dirs--;
 
-            const char* dir = r.read_string();
-            const char* dir_perms = r.read_string();
-            std::filesystem::file_time_type::rep t = (std::filesystem::file_time_type::rep)r.read_u64();
+            const char* dir = r.read_path();
+            const char* dir_perms = r.read_perms();
+            std::filesystem::file_time_type::rep t = (std::filesystem::file_time_type::rep)r.read_time();
 
             if (join_files) {
+                _keep(dir);
+            }
+            if (join_files && !selected(dir, true)) {
+                continue;
+            }
+            if (join_files && !make_parents(dir)) {
+                r.close();
+                free((void*)SPLIT_PREFIX);
+                free((void*)max_path);
+                return -1;
+            }
+            if (join_files) {
+                if (!only.empty()) {
+                    made_dirs.emplace(dir);
+                }
                 if (dry_run) {
                     fmt::print("mkdir {: >9} {}/{}\n", "", out_directory, dir);
                 }
                 else {
                     if (verbose_files) fmt::print("unpacking directory: {}/{}\n", out_directory, dir);
-                    if (!std::filesystem::create_directory(out_directory + "/" + dir)) {
+                    if (!_join_mkdir(dir)) {
                         fmt::print("failed to create directory: {}/{}\n", out_directory, dir);
                         r.close();
                         free((void*)SPLIT_PREFIX);
                         free((void*)max_path);
-                        free((void*)max_perms);
                         return -1;
                     }
                 }
-                dirs_vec.emplace_back(std::pair<const char*, std::pair<const char*, std::filesystem::file_time_type::rep>>(dir, std::pair<const char*, std::filesystem::file_time_type::rep>(dir_perms, t)));
+                char* dir_copy = strdup(dir);
+                if (dir_copy == nullptr) {
+                    throw std::bad_alloc();
+                }
+                dirs_vec.emplace_back(std::pair<const char*, std::pair<const char*, std::filesystem::file_time_type::rep>>(dir_copy, std::pair<const char*, std::filesystem::file_time_type::rep>(dir_perms, t)));
             }
             else {
                 fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", dir_perms, 0, 0, mfc, dir);
-                free((void*)dir);
-                free((void*)dir_perms);
             }
         }
         fmt::print("reading {} files with a total of {} split files consisting of {} chunks\n", files, split_number+1, chunks);
@@ -1470,158 +4907,152 @@ struct PathRecorder {
         uintmax_t totalc = 0;
         uintmax_t current_split = 0;
         bool split_open = false;
-        FILE* current_split_file = nullptr;
 
-        for (uintmax_t i = 0; i < files; i++) {
-            const char* file = r.read_string();
-            const char* file_perms = r.read_string();
-            std::filesystem::file_time_type::rep file_time = (std::filesystem::file_time_type::rep)r.read_u64();
+        uintmax_t first_file = 0;
+        if (parallel) {
+            list_blocks(map_blocks.files, files, INDEX_FILE, layout, list_chunks, mfc, total, totalc);
+            first_file = files;
+            r.seek(toc.symlinks);
+        }
+        r.reset_paths();
+        for (uintmax_t i = first_file; i < files; i++) {
+            const char* file = r.read_path();
+            const char* file_perms = r.read_perms();
+            std::filesystem::file_time_type::rep file_time = (std::filesystem::file_time_type::rep)r.read_time();
             uint64_t file_size = r.read_u64();
-            uint64_t file_chunks = r.read_u64();
+            ChunkCursor cursor = read_chunks(file_size);
+            uint64_t file_chunks = cursor.count;
             total += file_size;
 
+            if (join_files) {
+                _keep(file);
+            }
+            if (join_files && (!selected(file, false) || _join_unchanged(file, file_size, file_time, file_perms))) {
+                // a file left out by --only or unchanged on disk never touches its splits
+                for (uintmax_t i = 0; i < file_chunks; i++) {
+                    cursor.next();
+                }
+                continue;
+            }
+            if (join_files && !make_parents(file)) {
+                if (!join_batch.files.empty()) {
+                    _join_run(layout, split_base, false);
+                }
+                r.close();
+                free((void*)SPLIT_PREFIX);
+                free((void*)max_path);
+                return -1;
+            }
+
             if (join_files) {
                 if (dry_run) {
-                    fmt::print("fopen({}/{}, \"wb\")\n", out_directory, file);
+                    // a --splits join leaves a file alone unless the chosen splits hold part of it
+                    bool fragments = !split_state.empty();
+                    bool opened = !fragments || file_chunks == 0;
+                    if (opened) {
+                        fmt::print("fopen({}/{}, \"wb\")\n", out_directory, file);
+                    }
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
+                        if (fragments && !split_wanted(split)) {
+                            continue;
+                        }
+                        if (!opened) {
+                            fmt::print("open({}/{}, O_WRONLY | O_CREAT)\n", out_directory, file);
+                            opened = true;
+                        }
                         if (split != current_split) {
                             if (split_open) {
-                                fmt::print("fclose({}/{}split.{})\n", parent, SPLIT_PREFIX, current_split);
+                                fmt::print("close({})\n", layout.locate(split_base, current_split));
                                 split_open = false;
                             }
-                            if (remove_files) {
-                                fmt::print("rm -f {}/{}split.{}\n", parent, SPLIT_PREFIX, current_split);
+                            if (remove_files && !fragments) {
+                                fmt::print("rm -f {}\n", layout.locate(split_base, current_split));
                             }
                             current_split = split;
                         }
                         if (!split_open) {
-                            fmt::print("fopen({}/{}split.{}, \"rb\")\n", parent, SPLIT_PREFIX, split);
-                            fmt::print("fseek({}/{}split.{}, 0)\n", parent, SPLIT_PREFIX, split);
+                            fmt::print("open({})\n", layout.locate(split_base, split));
                             split_open = true;
                         }
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
-                        fmt::print("fread({}/{}split.{}, buf, {})\n", parent, SPLIT_PREFIX, split, length);
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
+                        fmt::print("pread({}, buf, {}, {})\n", layout.locate(split_base, split), length, offset);
                         fmt::print("fwrite({}/{}, buf, {})\n", out_directory, file, length);
                         totalc += length;
                     }
-                    fmt::print("fflush({}/{})\n", out_directory, file);
-                    fmt::print("fclose({}/{})\n", out_directory, file);
-                    fmt::print("chmod {: >9} {}/{}\n", file_perms, out_directory, file);
+                    if (opened) {
+                        fmt::print("fflush({}/{})\n", out_directory, file);
+                        fmt::print("fclose({}/{})\n", out_directory, file);
+                        fmt::print("chmod {: >9} {}/{}\n", file_perms, out_directory, file);
+                    }
                 }
                 else {
                     if (verbose_files) fmt::print("unpacking file: {}/{}\n", out_directory, file);
                     std::string out_f = out_directory + "/" + file;
-                    FILE * f = fopen(out_f.c_str(), "wb");
-                    if (f == nullptr) {
+                    if (!_join_add(file, out_f, file_perms, file_time, file_size, cursor, layout, split_base, split_number)) {
                         fmt::print("failed to create file: {}\n", out_f);
+                        _join_run(layout, split_base, false);
                         r.close();
                         free((void*)SPLIT_PREFIX);
                         free((void*)max_path);
-                        free((void*)max_perms);
                         return -1;
                     }
-                    for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
-                        if (split != current_split) {
-                            if (split_open) {
-                                fclose(current_split_file);
-                                current_split_file = nullptr;
-                                split_open = false;
-                            }
-                            if (remove_files) {
-                                auto path_to_remove = fmt::format("{}/{}split.{}", parent, SPLIT_PREFIX, current_split);
-                                try {
-                                    std::filesystem::remove(path_to_remove);
-                                }
-                                catch (std::exception& e) {
-                                    fmt::print("failed to remove path: {}\n", path_to_remove);
-                                }
-                            }
-                            current_split = split;
-                        }
-                        if (!split_open) {
-                            auto in_s = fmt::format("{}/{}split.{}", parent, SPLIT_PREFIX, split);
-                            current_split_file = fopen(in_s.c_str(), "rb");
-                            if (current_split_file == nullptr) {
-                                fmt::print("failed to open file: {}\n", in_s);
-                                fclose(f);
-                                r.close();
-                                free((void*)SPLIT_PREFIX);
-                                free((void*)max_path);
-                                free((void*)max_perms);
-                                return -1;
-                            }
-                            fseek(current_split_file, 0, SEEK_SET);
-                            split_open = true;
-                        }
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
-                        void* buffer = malloc(length);
-                        if (buffer == nullptr) {
-                            throw std::bad_alloc();
+                    totalc += file_size;
+                    if (join_batch.files.size() >= JOIN_BATCH_FILES || join_batch.bytes >= JOIN_BATCH_BYTES) {
+                        if (!_join_run(layout, split_base, false)) {
+                            r.close();
+                            free((void*)SPLIT_PREFIX);
+                            free((void*)max_path);
+                            return -1;
                         }
-                        fread(buffer, 1, length, current_split_file);
-                        fwrite(buffer, 1, length, f);
-                        free(buffer);
-                        totalc += length;
                     }
-                    fflush(f);
-                    fclose(f);
-                    f = nullptr;
-                    std::filesystem::permissions(out_f, permissions_to_filesystem(string_to_permissions(file_perms)));
-                    std::filesystem::last_write_time(out_f, std::filesystem::file_time_type(std::filesystem::file_time_type::duration(file_time)));
                 }
             }
             else {
                 if (list_chunks) {
                     fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", file_perms, file_size, file_chunks, mfc, file);
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
-                        fmt::print("   [chunk] {}split.{} [{: >{}}-{: >{}}]\n", SPLIT_PREFIX, split, offset, fmt::formatted_size("{}", SPLIT_SIZE), offset + length, fmt::formatted_size("{}", SPLIT_SIZE));
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
+                        fmt::print("   [chunk] {} [{: >{}}-{: >{}}]\n", layout.locate("", split), offset, fmt::formatted_size("{}", SPLIT_SIZE), offset + length, fmt::formatted_size("{}", SPLIT_SIZE));
                         totalc += length;
                     }
                 }
                 else {
                     fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", file_perms, file_size, file_chunks, mfc, file);
                     for (uintmax_t i = 0; i < file_chunks; i++) {
-                        uintmax_t split = r.read_u64();
-                        uintmax_t offset = r.read_u64();
-                        uintmax_t length = r.read_u64();
+                        ChunkInfo chunk = cursor.next();
+                        uintmax_t split = chunk.split;
+                        uintmax_t offset = chunk.offset;
+                        uintmax_t length = chunk.length;
                         totalc += length;
                     }
                 }
             }
 
-            free((void*)file);
-            free((void*)file_perms);
         }
         if (join_files) {
             if (split_open) {
                 if (dry_run) {
-                    fmt::print("fclose({}/{}split.{})\n", parent, SPLIT_PREFIX, current_split);
-                    if (remove_files) {
-                        fmt::print("rm -f {}/{}split.{}\n", parent, SPLIT_PREFIX, current_split);
-                    }
-                }
-                else {
-                    fclose(current_split_file);
-                    if (remove_files) {
-                        auto path_to_remove = fmt::format("{}/{}split.{}", parent, SPLIT_PREFIX, current_split);
-                        try {
-                            std::filesystem::remove(path_to_remove);
-                        }
-                        catch (std::exception& e) {
-                            fmt::print("failed to remove path: {}\n", path_to_remove);
-                        }
+                    fmt::print("close({})\n", layout.locate(split_base, current_split));
+                    if (remove_files && split_state.empty()) {
+                        fmt::print("rm -f {}\n", layout.locate(split_base, current_split));
                     }
-                    current_split_file = nullptr;
                 }
                 split_open = false;
             }
+            else if (!dry_run) {
+                if (!_join_run(layout, split_base, true)) {
+                    r.close();
+                    free((void*)SPLIT_PREFIX);
+                    free((void*)max_path);
+                    return -1;
+                }
+            }
         }
         if (total >= 1000) {
             fmt::print("total size of {: >{}} files:  {: >{}} bytes ({})\n", files, fmt::formatted_size("{}", std::max(files, chunks)), total, fmt::formatted_size("{}", std::max(total, totalc)), make_human_readable_str(total));
@@ -1637,12 +5068,33 @@ struct PathRecorder {
         auto s = fmt::format("{: >{}} {}", sz, fmt::formatted_size("{}", max_size), sz >= 1000 ? fmt::format("({: >6})", make_human_readable_str(sz)) : "        ");
         fmt::print("largest file: {: >{}}         {} {}   ({: >{}} chunks)   {}\n", "", fmt::formatted_size("{}", std::max(files, chunks)), max_perms, s, max_chunk, mfc, max_path);
         fmt::print("reading {} symlinks\n", symlinks);
+        r.reset_paths();
+        r.read_string_table();
+        if (parallel) {
+            list_blocks(map_blocks.symlinks, symlinks, INDEX_SYMLINK, layout, list_chunks, mfc, total, totalc);
+            symlinks = 0;
+        }
         while (symlinks != 0) {
             symlinks--;
 
-            const char* symlink = r.read_string();
-            const char* symlink_dest = r.read_string();
+            const char* symlink = r.read_path();
+            std::string_view symlink_dest = r.read_string_ref();
 
+            if (join_files) {
+                _keep(symlink);
+            }
+            if (join_files && !selected(symlink, false)) {
+                continue;
+            }
+            if (join_files && !make_parents(symlink)) {
+                r.close();
+                free((void*)SPLIT_PREFIX);
+                free((void*)max_path);
+                return -1;
+            }
+            if (join_files && _join_same_link(symlink, symlink_dest)) {
+                continue;
+            }
             if (join_files) {
                 if (dry_run) {
                     fmt::print("ln -s {} {}/{}\n", symlink_dest, out_directory, symlink);
@@ -1663,7 +5115,6 @@ struct PathRecorder {
                     //    r.close();
                     //    free((void*)SPLIT_PREFIX);
                     //    free((void*)max_path);
-                    //    free((void*)max_perms);
                     //    return -1;
                     //}
                     //auto parent = sp;
@@ -1672,7 +5123,6 @@ struct PathRecorder {
                     //    r.close();
                     //    free((void*)SPLIT_PREFIX);
                     //    free((void*)max_path);
-                    //    free((void*)max_perms);
                     //    return -1;
                     //}
                     //parent = parent.parent_path();
@@ -1698,12 +5148,14 @@ struct PathRecorder {
             else {
                 fmt::print("{} {: >8}   ({: >{}} chunks)   {} -> {}\n", "lrwxrwxrwx", 0, 0, mfc, symlink, symlink_dest);
             }
-            free((void*)symlink);
-            free((void*)symlink_dest);
         }
         if (join_files) {
             for (auto& dirs : dirs_vec) {
-                if (dry_run) {
+                if (defer_dirs) {
+                    // a later shard may still add items to this directory
+                    deferred_dirs.push_back({dirs.first, dirs.second.first, dirs.second.second});
+                }
+                else if (dry_run) {
                     fmt::print("chmod {: >9} {}/{}\n", dirs.second.first, out_directory, dirs.first);
                 }
                 else {
@@ -1711,26 +5163,499 @@ struct PathRecorder {
                     std::filesystem::last_write_time(out_directory + "/" + dirs.first, std::filesystem::file_time_type(std::filesystem::file_time_type::duration(dirs.second.second)));
                 }
                 free((void*)dirs.first);
-                free((void*)dirs.second.first);
             }
         }
+#ifndef _WIN32
+        join_dirs.close_all();
+#endif
         r.close();
         free((void*)SPLIT_PREFIX);
         free((void*)max_path);
-        free((void*)max_perms);
         return 0;
     }
-    int playback(const char* path, bool join_files, bool list_chunks) {
+    // the header fields of a split map
+    struct MapHeader {
+        SplitLayout layout;
+        std::string max_path;
+        std::string max_perms;
+        uint64_t dirs = 0;
+        uint64_t files = 0;
+        uint64_t chunks = 0;
+        uint64_t max_file_chunks = 0;
+        uint64_t split_number = 0;
+        uintmax_t max_size = 0;
+        uintmax_t max_chunk = 0;
+        uint64_t symlinks = 0;
+    };
+
+    int read_header(const char* path, MapHeader& header) {
+        r.open(path);
+        std::string e;
+        if (!r.read_magic(e)) {
+            fmt::print("{}\n", e);
+            r.close();
+            return -1;
+        }
+        read_layout(header.layout);
+        SPLIT_SIZE = r.read_u64();
+        const char* str = r.read_string();
+        header.layout.prefix = str;
+        free((void*)str);
+        header.dirs = r.read_u64();
+        header.files = r.read_u64();
+        header.chunks = r.read_u64();
+        header.max_file_chunks = r.read_u64();
+        header.split_number = r.read_u64();
+        str = r.read_string();
+        header.max_path = str;
+        free((void*)str);
+        header.max_perms = r.read_perms();
+        header.max_size = r.read_u64();
+        header.max_chunk = r.read_u64();
+        header.symlinks = r.read_u64();
+        r.read_time_base();
+        read_shards();
+        return 0;
+    }
+
+    bool read_toc(MapToc& toc) {
+        uint64_t offset;
+        char trailer[8];
+        if (r.version < 2 || r.size < 16) {
+            return false;
+        }
+        r.seek(r.size - 16);
+        if (!r.read_raw(&offset, 8) || !r.read_raw(trailer, 8) || memcmp(trailer, MAP_TRAILER, 8) != 0) {
+            return false;
+        }
+        r.seek(offset);
+        toc.dirs = r.read_u64();
+        toc.files = r.read_u64();
+        toc.symlinks = r.read_u64();
+        toc.index = r.read_u64();
+        toc.restarts = r.read_u64();
+        toc.bloom = r.read_u64();
+        if ((r.flags & MAP_FLAG_BLOCKS) != 0) {
+            toc.blocks = r.read_u64();
+        }
+        if ((r.flags & MAP_FLAG_SUMMARY) != 0) {
+            toc.summary = r.read_u64();
+        }
+        return true;
+    }
+
+    // reads the block offsets of a map, returns false if it has none, the
+    // reader is left where it was
+    bool read_blocks(MapToc& toc, MapBlocks& map_blocks) {
+        uint64_t pos = r.tell();
+        bool ok = read_toc(toc) && (r.flags & MAP_FLAG_BLOCKS) != 0;
+        if (ok) {
+            r.seek(toc.blocks);
+            for (auto* section : {&map_blocks.dirs, &map_blocks.files, &map_blocks.symlinks}) {
+                section->resize(r.read_u64());
+                for (auto& block : *section) {
+                    block.offset = r.read_u64();
+                    block.first = r.read_u64();
+                }
+            }
+        }
+        r.seek(pos);
+        return ok;
+    }
+
+    void read_index_entry(IndexEntry& e) {
+        e.path = r.read_path();
+        e.kind = r.read_u8();
+        e.offset = r.read_u64();
+        e.subtree = r.read_u64();
+    }
+
+    // lists the record an index entry points to, the reader is left where it was
+    void list_record(const IndexEntry& e, size_t mfc, const SplitLayout& layout) {
+        uint64_t pos = r.tell();
+        r.seek(e.offset);
+        r.skip_path();
+        if (e.kind == INDEX_SYMLINK) {
+            std::string_view dest = r.read_string_ref();
+            fmt::print("{} {: >8}   ({: >{}} chunks)   {} -> {}\n", "lrwxrwxrwx", 0, 0, mfc, e.path, dest);
+        }
+        else if (e.kind == INDEX_DIR) {
+            const char* perms = r.read_perms();
+            r.read_time();
+            fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", perms, 0, 0, mfc, e.path);
+        }
+        else {
+            const char* perms = r.read_perms();
+            r.read_time();
+            uint64_t file_size = r.read_u64();
+            ChunkCursor cursor = read_chunks(file_size);
+            fmt::print("{} {: >8}   ({: >{}} chunks)   {}\n", perms, file_size, cursor.count, mfc, e.path);
+            for (uintmax_t i = 0; i < cursor.count; i++) {
+                ChunkInfo chunk = cursor.next();
+                fmt::print("   [chunk] {} [{: >{}}-{: >{}}]\n", layout.locate("", chunk.split), chunk.offset, fmt::formatted_size("{}", SPLIT_SIZE), chunk.offset + chunk.length, fmt::formatted_size("{}", SPLIT_SIZE));
+            }
+        }
+        r.seek(pos);
+    }
+
+    // looks a path up in the index of a split map and lists its record, a
+    // directory also lists everything below it
+    //
+    // returns 1 if the path is not in the split map
+    //
+    int find(const char* path, std::string query, std::string location = {}) {
+        if (is_url(path)) {
+            TempFileFILE tmp_split_map;
+            tmp_split_map.construct(TempFile::TempDir(), "split.map.", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE | TEMP_FILE_OPEN_MODE_BINARY, !remove_files);
+            fmt::print("downloading item: {}\n", path);
+            if (download_url(path, tmp_split_map) == -1) {
+                fmt::print("failed to download item: {}\n", path);
+                return -1;
+            }
+            fflush(tmp_split_map.get_handle());
+            return find(tmp_split_map.get_path().c_str(), query, path);
+        }
+        if (!path_exists(std::filesystem::path(path))) {
+            fmt::print("item does not exist: {}\n", path);
+            return -1;
+        }
+        if (location.empty()) {
+            location = path;
+        }
+        while (query.rfind("./", 0) == 0) {
+            query.erase(0, 2);
+        }
+        while (!query.empty() && query.front() == '/') {
+            query.erase(0, 1);
+        }
+        while (!query.empty() && query.back() == '/') {
+            query.pop_back();
+        }
+
+        MapHeader header;
+        shards.clear();
+        if (read_header(path, header) == -1) {
+            return -1;
+        }
+        // a path below a shard is only recorded in the map of that shard
+        std::vector<ShardInfo> root_shards = std::move(shards);
+        shards.clear();
+        for (size_t i = 0; i < root_shards.size(); i++) {
+            const std::string& key = root_shards[i].key;
+            if (query.size() > key.size() && query[key.size()] == '/' && query.compare(0, key.size(), key) == 0) {
+                r.close();
+                return find(fmt::format("{}.{}", location, i).c_str(), query);
+            }
+        }
+        MapToc toc;
+        if (!read_toc(toc)) {
+            fmt::print("split map has no index, use --ls without --find\n");
+            r.close();
+            return -1;
+        }
+        size_t mfc = fmt::formatted_size("{}", header.max_file_chunks);
+
+        // the bloom filter rules out most missing paths without a search
+        PathBloom bloom;
+        r.seek(toc.bloom);
+        bloom.bits.resize(r.read_u64());
+        bloom.hashes = r.read_u8();
+        r.read_raw(bloom.bits.data(), bloom.bits.size());
+        if (!bloom.maybe_contains(query)) {
+            fmt::print("not found: {}\n", query);
+            r.close();
+            return 1;
+        }
+
+        r.seek(toc.restarts);
+        std::vector<uint64_t> restarts(r.read_u64());
+        for (uint64_t& restart : restarts) {
+            restart = r.read_u64();
+        }
+        r.seek(toc.index);
+        uint64_t entries = r.read_u64();
+        if (header.symlinks != 0) {
+            r.seek(toc.symlinks);
+            r.read_string_table();
+        }
+
+        // find the last block whose first path is not after the query, the
+        // first path of each block is stored in full
+        size_t lo = 0;
+        size_t hi = restarts.size();
+        IndexEntry e;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            r.seek(restarts[mid]);
+            r.reset_paths();
+            read_index_entry(e);
+            if (path_less(query, e.path)) {
+                hi = mid;
+            }
+            else {
+                lo = mid;
+            }
+        }
+        bool found = false;
+        if (!restarts.empty()) {
+            r.seek(restarts[lo]);
+            r.reset_paths();
+            for (uint64_t i = lo * MAP_INDEX_RESTART; i < entries; i++) {
+                read_index_entry(e);
+                if (e.path == query) {
+                    found = true;
+                    break;
+                }
+                if (path_less(query, e.path)) {
+                    break;
+                }
+            }
+        }
+        if (!found) {
+            fmt::print("not found: {}\n", query);
+            r.close();
+            return 1;
+        }
+        list_record(e, mfc, header.layout);
+        // the entries below a directory follow it in the index
+        for (uint64_t i = 0, subtree = e.subtree; i < subtree; i++) {
+            read_index_entry(e);
+            list_record(e, mfc, header.layout);
+        }
+        r.close();
+        // followed by every shard below it
+        for (size_t i = 0; i < root_shards.size(); i++) {
+            const std::string& key = root_shards[i].key;
+            if (key == query || (key.size() > query.size() && key[query.size()] == '/' && key.compare(0, query.size(), query) == 0)) {
+                if (list_shard(fmt::format("{}.{}", location, i).c_str()) == -1) {
+                    return -1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // reads the summary of a split map that has MAP_FLAG_SUMMARY
+    void read_summary(const MapToc& toc) {
+        r.seek(toc.summary);
+        summary = {};
+        summary.sizes.resize(r.read_u64());
+        for (auto& bucket : summary.sizes) {
+            bucket.files = r.read_u64();
+            bucket.bytes = r.read_u64();
+        }
+        summary.top.resize(r.read_u64());
+        for (auto& entry : summary.top) {
+            entry.name = r.read_view();
+            entry.dirs = r.read_u64();
+            entry.files = r.read_u64();
+            entry.symlinks = r.read_u64();
+            entry.bytes = r.read_u64();
+        }
+        summary.splits.resize(r.read_u64());
+        for (auto& split : summary.splits) {
+            split.bytes = r.read_u64();
+            split.chunks = r.read_u64();
+        }
+    }
+
+    // prints the summary section of a split map, the entries are not decoded
+    // but a deflated map is inflated up to the summary to seek there
+    int show_summary(const char* path) {
+        if (is_url(path)) {
+            TempFileFILE tmp_split_map;
+            tmp_split_map.construct(TempFile::TempDir(), "split.map.", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE | TEMP_FILE_OPEN_MODE_BINARY, !remove_files);
+            fmt::print("downloading item: {}\n", path);
+            if (download_url(path, tmp_split_map) == -1) {
+                fmt::print("failed to download item: {}\n", path);
+                return -1;
+            }
+            fflush(tmp_split_map.get_handle());
+            return show_summary(tmp_split_map.get_path().c_str());
+        }
+        if (!path_exists(std::filesystem::path(path))) {
+            fmt::print("item does not exist: {}\n", path);
+            return -1;
+        }
+        MapHeader header;
+        if (read_header(path, header) == -1) {
+            return -1;
+        }
+        MapToc toc;
+        if (!read_toc(toc) || (r.flags & MAP_FLAG_SUMMARY) == 0) {
+            fmt::print("split map has no summary, use --ls without --summary\n");
+            r.close();
+            return -1;
+        }
+        read_summary(toc);
+        r.close();
+
+        MapSummary::Entry all;
+        for (auto& entry : summary.top) {
+            all.dirs += entry.dirs;
+            all.files += entry.files;
+            all.symlinks += entry.symlinks;
+            all.bytes += entry.bytes;
+        }
+        size_t w = fmt::formatted_size("{}", std::max<uint64_t>(all.files, all.bytes));
+        fmt::print("split size:           {}\n", SPLIT_SIZE);
+        fmt::print("split prefix:         {}\n", header.layout.prefix);
+        fmt::print("split files:          {}\n", summary.splits.size());
+        fmt::print("shards:               {}\n", shards.size());
+        fmt::print("directories:          {}\n", all.dirs);
+        fmt::print("files:                {}\n", all.files);
+        fmt::print("symlinks:             {}\n", all.symlinks);
+        fmt::print("total size:           {} ({})\n", all.bytes, make_human_readable_str(all.bytes));
+        fmt::print("largest file:         {} ({})   {}\n", header.max_size, make_human_readable_str(header.max_size), header.max_path);
+        fmt::print("file sizes:\n");
+        for (size_t i = 0; i < summary.sizes.size(); i++) {
+            if (summary.sizes[i].files == 0) {
+                continue;
+            }
+            uint64_t low = i == 0 ? 0 : (uint64_t)1 << (i - 1);
+            uint64_t high = i == 0 ? 0 : low + (low - 1);
+            fmt::print("  {: >6} - {: <6}  {: >{}} files  {: >{}} bytes ({})\n", make_human_readable_str(low), make_human_readable_str(high), summary.sizes[i].files, w, summary.sizes[i].bytes, w, make_human_readable_str(summary.sizes[i].bytes));
+        }
+        fmt::print("top-level entries:\n");
+        for (auto& entry : summary.top) {
+            fmt::print("  {: >{}} bytes ({: >6})  {: >{}} files  {} dirs  {} symlinks   {}\n", entry.bytes, w, make_human_readable_str(entry.bytes), entry.files, w, entry.dirs, entry.symlinks, entry.name);
+        }
+        fmt::print("split fill:\n");
+        for (size_t i = 0; i < summary.splits.size(); i++) {
+            auto& split = summary.splits[i];
+            fmt::print("  {: >{}} bytes ({: >3}% full)  {} chunks   {}\n", split.bytes, fmt::formatted_size("{}", SPLIT_SIZE), SPLIT_SIZE == 0 ? 0 : split.bytes * 100 / SPLIT_SIZE, split.chunks, header.layout.locate("", i));
+        }
+        return 0;
+    }
+
+    // lists every entry in the index of a shard map
+    int list_shard(const char* path) {
+        if (is_url(path)) {
+            TempFileFILE tmp_split_map;
+            tmp_split_map.construct(TempFile::TempDir(), "split.map.", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE | TEMP_FILE_OPEN_MODE_BINARY, !remove_files);
+            fmt::print("downloading item: {}\n", path);
+            if (download_url(path, tmp_split_map) == -1) {
+                fmt::print("failed to download item: {}\n", path);
+                return -1;
+            }
+            fflush(tmp_split_map.get_handle());
+            return list_shard(tmp_split_map.get_path().c_str());
+        }
+        if (!path_exists(std::filesystem::path(path))) {
+            fmt::print("item does not exist: {}\n", path);
+            return -1;
+        }
+        MapHeader header;
+        if (read_header(path, header) == -1) {
+            return -1;
+        }
+        MapToc toc;
+        if (!read_toc(toc)) {
+            fmt::print("split map has no index: {}\n", path);
+            r.close();
+            return -1;
+        }
+        size_t mfc = fmt::formatted_size("{}", header.max_file_chunks);
+        if (header.symlinks != 0) {
+            r.seek(toc.symlinks);
+            r.read_string_table();
+        }
+        r.seek(toc.index);
+        r.reset_paths();
+        IndexEntry e;
+        for (uint64_t i = 0, entries = r.read_u64(); i < entries; i++) {
+            read_index_entry(e);
+            list_record(e, mfc, header.layout);
+        }
+        r.close();
+        return 0;
+    }
+
+    int playback_map(const char* path, bool join_files, bool list_chunks) {
         return is_url(path) ? playback_url(path, join_files, list_chunks) : playback_file(path, join_files, list_chunks);
     }
+
+    // the first split of the shards from the given one on, splits from there
+    // on are still needed by a later map
+    uint64_t next_shard_split(size_t from) {
+        for (size_t j = from; j < shards.size(); j++) {
+            if (shards[j].first_split != UINT64_MAX) {
+                return shards[j].first_split;
+            }
+        }
+        return UINT64_MAX;
+    }
+
+    // plays a split map back, a sharded split map plays the root map and then
+    // each shard map in the order their data was packed
+    //
+    // directory permissions and times are applied once every map has been
+    // played, a shard may add items to a directory of the root map
+    //
+    int playback(const char* path, bool join_files, bool list_chunks) {
+        if (join_files && _splits_begin(path) == -1) {
+            return -1;
+        }
+        shards.clear();
+        deferred_dirs.clear();
+        defer_dirs = true;
+        keep_split_from = UINT64_MAX;
+        only = {};
+        made_dirs.clear();
+        join_kept.clear();
+        resume_reached = false;
+        if (join_files) {
+            for (auto& pattern : ONLY_PATTERNS) {
+                only.add(pattern, true);
+            }
+        }
+        int ret = playback_map(path, join_files, list_chunks);
+        joining_shard = true;
+        for (size_t i = 0; ret == 0 && i < shards.size(); i++) {
+            keep_split_from = next_shard_split(i + 1);
+            if (join_files && !selected_shard(shards[i].key)) {
+                continue;
+            }
+            auto shard_path = fmt::format("{}.{}", path, i);
+            fmt::print("reading shard: {}\n", shards[i].key);
+            ret = playback_map(shard_path.c_str(), join_files, list_chunks);
+        }
+        joining_shard = false;
+        defer_dirs = false;
+        keep_split_from = UINT64_MAX;
+        if (ret == 0 && join_files && JOIN_DELETE) {
+            ret = _join_delete_extras();
+        }
+        if (join_files && !split_state.empty()) {
+            int end = _splits_end(ret == 0);
+            ret = ret == 0 ? end : ret;
+        }
+        if (ret == 0 && join_files) {
+            for (auto& dir : deferred_dirs) {
+                if (dry_run) {
+                    fmt::print("chmod {: >9} {}/{}\n", dir.perms, out_directory, dir.path);
+                }
+                else {
+                    std::filesystem::permissions(out_directory + "/" + dir.path, permissions_to_filesystem(string_to_permissions(dir.perms.c_str())));
+                    std::filesystem::last_write_time(out_directory + "/" + dir.path, std::filesystem::file_time_type(std::filesystem::file_time_type::duration(dir.time)));
+                }
+            }
+        }
+        deferred_dirs.clear();
+        return ret;
+    }
 };
 
 void split_usage() {
-    fmt::print("\n--split  [-n] [-r] [--size <split_size>] [--name <name>] <dir/file>\n");
+    fmt::print("\n--split  [-n] [-r] [--size <split_size>] [--name <name>] [--fanout <depth>]\n");
+    fmt::print("         [--out-dirs <dir,dir,...>] [--out-policy <rr|space>] [--files-from <file|->]\n");
+    fmt::print("         [--exclude <pattern>] [--include <pattern>] [--map-version <1|2>]\n");
+    fmt::print("         [--compress-map] [--shard <depth>] <dir/file>\n");
     fmt::print("         info\n");
     fmt::print("                 split a directory/file into fixed size chunks\n");
     fmt::print("                 symlinks WILL NOT be followed\n");
     fmt::print("                 the split files will be created in the current working directory\n");
+    fmt::print("                 unless --out-dirs is given, the split map is always created there\n");
     fmt::print("         -n\n");
     fmt::print("                 form the split map only, does not store any content\n");
     fmt::print("         -r\n");
@@ -1745,12 +5670,65 @@ void split_usage() {
     fmt::print("         --name\n");
     fmt::print("                 specifies the prefix to be added to split.* files\n");
     fmt::print("                 if this options is not specified then an empty prefix is used\n");
+    fmt::print("         --fanout\n");
+    fmt::print("                 store split files in a directory tree of the given depth\n");
+    fmt::print("                 each level groups 100 splits, for example with a depth of 2\n");
+    fmt::print("                   [prefix.]splits/00/12/split.1234\n");
+    fmt::print("                 the depth is recorded in the split map, --join and --ls need no option\n");
+    fmt::print("                 if this options is not specified then a depth of 0 (flat) is used\n");
+    fmt::print("         --out-dirs\n");
+    fmt::print("                 a comma separated list of directories to distribute split files across\n");
+    fmt::print("                 splits placed in different directories are written in parallel\n");
+    fmt::print("                 the directory of each split is recorded in the split map\n");
+    fmt::print("                 relative directories are resolved against the split map when joining\n");
+    fmt::print("                 when joining from a URL each directory is expected under the URL\n");
+    fmt::print("                 by its final path component\n");
+    fmt::print("         --out-policy\n");
+    fmt::print("                 rr     distribute splits round-robin (the default)\n");
+    fmt::print("                 space  place each split in the directory with the most free space\n");
+    fmt::print("         --files-from\n");
+    fmt::print("                 only store the paths listed in the given file, or stdin if - is given\n");
+    fmt::print("                 paths are relative to <dir> and separated by newlines or NULs\n");
+    fmt::print("                 the directory is not walked, listed directories are stored without their content\n");
+    fmt::print("                 the parent directories of each path are stored automatically\n");
+    fmt::print("                 if -r is given, only listed items are removed\n");
+    fmt::print("         --exclude\n");
+    fmt::print("                 do not store items matching the given pattern, may be given multiple times\n");
+    fmt::print("                 a matching directory is skipped entirely, its content is never read\n");
+    fmt::print("                 a pattern without a '/' matches a name at any depth, for example .git\n");
+    fmt::print("                 a pattern containing a '/' is matched against the path relative to <dir>\n");
+    fmt::print("                 a trailing '/' only matches directories\n");
+    fmt::print("                   *  matches anything except '/', ** matches anything including '/'\n");
+    fmt::print("                   ?  matches one character, [a-z] matches one character of a set\n");
+    fmt::print("         --include\n");
+    fmt::print("                 store items matching the given pattern even if they are excluded\n");
+    fmt::print("                 the parent directories of included items are stored automatically\n");
+    fmt::print("         --map-version\n");
+    fmt::print("                 the split map format to write, the default is 2\n");
+    fmt::print("                 1  the original tagged format, readable by older versions\n");
+    fmt::print("                 2  a compact format without type tags, using variable length integers\n");
+    fmt::print("                 --join and --ls read both formats\n");
+    fmt::print("         --compress-map\n");
+    fmt::print("                 deflate the split map, --join and --ls inflate it as they read it\n");
+    fmt::print("                 this shrinks what --ls and --join download for large URL split maps\n");
+    fmt::print("                 requires split map version 2\n");
+    fmt::print("         --shard\n");
+    fmt::print("                 write one split map per directory at the given depth next to a small root map\n");
+    fmt::print("                 the shards are named after the split map with a .N suffix, for example\n");
+    fmt::print("                   [prefix.]split.map.0\n");
+    fmt::print("                 --ls --find of a path reads only the root map and the shard holding it\n");
+    fmt::print("                 --join and --ls read every shard, items above the depth stay in the root map\n");
+    fmt::print("                 requires split map version 2, cannot be used with --files-from\n");
     fmt::print("         <dir/file>\n");
     fmt::print("                 directory/file to split\n");
+    fmt::print("                 if - is given, stdin is split as a single file named after --name\n");
+    fmt::print("                 its size does not need to be known, the split map is written at EOF\n");
 }
 
 void join_usage() {
-    fmt::print("\n--join   [-n] [-r] [[prefix.]split.map | [http|https|ftp|ftps]://URL ] --out <out_dir>\n");
+    fmt::print("\n--join   [-n] [-r] [--threads <n>] [--only <pattern>]\n");
+    fmt::print("         [--update [--delete]] [--resume]\n");
+    fmt::print("         [--splits <n,n-m,...|present>] [[prefix.]split.map | [http|https|ftp|ftps]://URL ] --out <out_dir>\n");
     fmt::print("         info\n");
     fmt::print("                 join a split map to restore a directory/file\n");
     fmt::print("         -n\n");
@@ -1785,12 +5763,52 @@ void join_usage() {
     fmt::print("         --out\n");
     fmt::print("                 the directory to restore a directory/file into\n");
     fmt::print("                 defaults to the current directory\n");
+    fmt::print("         --threads\n");
+    fmt::print("                 the number of files and chunks of large files restored at once from local splits\n");
+    fmt::print("                 defaults to 0, one per core, a split map from a URL is always restored in order\n");
+    fmt::print("         --only\n");
+    fmt::print("                 only restore the entries matching a pattern, may be given more than once\n");
+    fmt::print("                 patterns follow the rules of --split --exclude, a directory brings everything below it\n");
+    fmt::print("                 only the splits holding the chunks of matching files are read or downloaded\n");
+    fmt::print("                 the directories above a matching entry are created with default permissions\n");
+    fmt::print("                 cannot be used with -r\n");
+    fmt::print("         --update\n");
+    fmt::print("                 join into a directory that is not empty, only rewriting the files whose size or\n");
+    fmt::print("                 modification time differ from the split map, the splits of unchanged files are not read\n");
+    fmt::print("                 cannot be used with -r\n");
+    fmt::print("         --delete\n");
+    fmt::print("                 with --update, remove everything in the output directory that the split map does not list\n");
+    fmt::print("                 cannot be used with --only\n");
+    fmt::print("         --resume\n");
+    fmt::print("                 continue a join that was interrupted, the files it finished are found by their size\n");
+    fmt::print("                 and modification time up to the first one that is not, which is rewritten along with\n");
+    fmt::print("                 everything after it, the splits of finished files are not read again\n");
+    fmt::print("                 give -r again if the interrupted join was given -r\n");
+    fmt::print("         --splits\n");
+    fmt::print("                 only write the parts of files held by the given splits, such as 17-42 or 0,5,9-12\n");
+    fmt::print("                 present picks every split that is already complete, so a join can run as splits arrive\n");
+    fmt::print("                 or each machine can join its own range of splits into shared storage\n");
+    fmt::print("                 a version 1 split map does not record the size of its last split, name it once it has arrived\n");
+    fmt::print("                 the joined splits are listed in [prefix.]split.map.done and skipped by later joins,\n");
+    fmt::print("                 a file gets its permissions and time from the last of the joins writing it to finish\n");
+    fmt::print("                 with -r each joined split is removed, URLs are not supported\n");
 }
 
 void ls_usage() {
-    fmt::print("\n--ls     [[prefix.]split.map | [http|https|ftp|ftps]://URL ]\n");
+    fmt::print("\n--ls     [--find <path>] [--summary] [[prefix.]split.map | [http|https|ftp|ftps]://URL ]\n");
     fmt::print("         info\n");
     fmt::print("                 list the contents of a split map\n");
+    fmt::print("         --find\n");
+    fmt::print("                 only list the given path and the splits holding its chunks\n");
+    fmt::print("                 a directory also lists everything below it\n");
+    fmt::print("                 the path is looked up in the index of the split map without reading\n");
+    fmt::print("                 the rest of it, version 1 split maps have no index\n");
+    fmt::print("         --summary\n");
+    fmt::print("                 print statistics recorded when the split map was made, without reading its entries\n");
+    fmt::print("                 a histogram of file sizes, the size and entry counts of each top-level entry\n");
+    fmt::print("                 and how full each split file is and how many chunks it holds\n");
+    fmt::print("                 a split map made with --compress-map is still inflated up to the summary\n");
+    fmt::print("                 version 1 split maps have no summary\n");
     fmt::print("         [prefix.]\n");
     fmt::print("                 an optional prefix for the split map\n");
     fmt::print("         [http|https|ftp|ftps]://URL\n");
@@ -1854,8 +5872,31 @@ int main(int argc, const char** argv) {
                     }
                     // the next argument must be a dir/file
                     PathRecorder p;
+                    if (FIND_PATH.length() != 0) {
+                        return p.find(file.c_str(), FIND_PATH);
+                    }
+                    if (LS_SUMMARY) {
+                        return p.show_summary(file.c_str());
+                    }
                     return p.playback(file.c_str(), false, false);
                 }
+                if (next_is_find) {
+                    FIND_PATH = argv[0];
+                    if (FIND_PATH.length() == 0) {
+                        fmt::print("--find requires a path\n");
+                        return -1;
+                    }
+                    next_is_find = false;
+                    continue;
+                }
+                if (strcmp(argv[0], "--find") == 0) {
+                    next_is_find = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--summary") == 0) {
+                    LS_SUMMARY = true;
+                    continue;
+                }
                 // any other arg MIGHT be invalid, show help if explicitly requested
                 if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
                     next_is_help = true;
@@ -1872,11 +5913,33 @@ int main(int argc, const char** argv) {
                         next_is_help = true;
                         continue;
                     }
-                    if (!path_exists(file)) {
+                    if (MAP_COMPRESS && MAP_VERSION < 2) {
+                        fmt::print("--compress-map requires split map version 2\n");
+                        return -1;
+                    }
+                    if (SHARD_DEPTH != 0 && MAP_VERSION < 2) {
+                        fmt::print("--shard requires split map version 2\n");
+                        return -1;
+                    }
+                    if (SHARD_DEPTH != 0 && !FILES_FROM.empty()) {
+                        fmt::print("--shard cannot be used with --files-from\n");
+                        return -1;
+                    }
+                    if (file == "-") {
+                        if (SPLIT_PREFIX.length() == 0) {
+                            fmt::print("splitting stdin requires --name\n");
+                            return -1;
+                        }
+                        if (FILES_FROM == "-") {
+                            fmt::print("--files-from cannot read stdin when splitting stdin\n");
+                            return -1;
+                        }
+                    }
+                    else if (!path_exists(file)) {
                         fmt::print("item does not exist: {}\n", file);
                         return -1;
                     }
-                    if (remove_files) {
+                    if (remove_files && file != "-") {
                         // TODO: make this work for a non-existing symlink
                         auto cwd = std::filesystem::current_path();
                         auto current = cwd;
@@ -1937,6 +6000,83 @@ int main(int argc, const char** argv) {
                     next_is_size = false;
                     continue;
                 }
+                if (next_is_map_version) {
+                    int version = atoi(argv[0]);
+                    if (version < 1 || version > MAP_VERSION_MAX) {
+                        fmt::print("split map version must be between 1 and {}: {}\n", MAP_VERSION_MAX, argv[0]);
+                        return -1;
+                    }
+                    MAP_VERSION = version;
+                    next_is_map_version = false;
+                    continue;
+                }
+                if (next_is_exclude) {
+                    EXCLUDE_PATTERNS.emplace_back(argv[0]);
+                    next_is_exclude = false;
+                    continue;
+                }
+                if (next_is_include) {
+                    INCLUDE_PATTERNS.emplace_back(argv[0]);
+                    next_is_include = false;
+                    continue;
+                }
+                if (next_is_files_from) {
+                    FILES_FROM = argv[0];
+                    next_is_files_from = false;
+                    continue;
+                }
+                if (next_is_out_dirs) {
+                    std::string dirs = argv[0];
+                    size_t start = 0;
+                    while (start <= dirs.length()) {
+                        size_t end = dirs.find(',', start);
+                        if (end == std::string::npos) end = dirs.length();
+                        if (end != start) {
+                            SPLIT_OUT_DIRS.emplace_back(dirs.substr(start, end - start));
+                        }
+                        start = end + 1;
+                    }
+                    if (SPLIT_OUT_DIRS.size() > UINT16_MAX) {
+                        fmt::print("too many output directories: {}\n", SPLIT_OUT_DIRS.size());
+                        return -1;
+                    }
+                    next_is_out_dirs = false;
+                    continue;
+                }
+                if (next_is_out_policy) {
+                    if (strcmp(argv[0], "rr") == 0) {
+                        SPLIT_OUT_BY_SPACE = false;
+                    }
+                    else if (strcmp(argv[0], "space") == 0) {
+                        SPLIT_OUT_BY_SPACE = true;
+                    }
+                    else {
+                        fmt::print("unknown output policy: {}\n", argv[0]);
+                        return -1;
+                    }
+                    next_is_out_policy = false;
+                    continue;
+                }
+                if (next_is_fanout) {
+                    int depth = atoi(argv[0]);
+                    if (depth < 0 || depth > 8) {
+                        fmt::print("fanout depth must be between 0 and 8: {}\n", argv[0]);
+                        return -1;
+                    }
+                    SPLIT_FANOUT = (uint8_t)depth;
+                    next_is_fanout = false;
+                    continue;
+                }
+                if (next_is_shard) {
+                    int depth = atoi(argv[0]);
+                    if (depth < 0 || depth > 255) {
+                        fmt::print("shard depth must be between 0 and 255: {}\n", argv[0]);
+                        return -1;
+                    }
+                    SHARD_DEPTH = (uint16_t)depth;
+                    next_is_shard = false;
+                    continue;
+                }
                 if (strcmp(argv[0], "-n") == 0) {
                     dry_run = true;
                     continue;
@@ -1957,6 +6097,42 @@ int main(int argc, const char** argv) {
                     next_is_name = true;
                     continue;
                 }
+                if (strcmp(argv[0], "--fanout") == 0) {
+                    next_is_fanout = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--out-dirs") == 0) {
+                    next_is_out_dirs = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--files-from") == 0) {
+                    next_is_files_from = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--exclude") == 0) {
+                    next_is_exclude = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--map-version") == 0) {
+                    next_is_map_version = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--compress-map") == 0) {
+                    MAP_COMPRESS = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--shard") == 0) {
+                    next_is_shard = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--include") == 0) {
+                    next_is_include = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--out-policy") == 0) {
+                    next_is_out_policy = true;
+                    continue;
+                }
                 // any other arg MIGHT be invalid, show help if explicitly requested
                 if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
                     next_is_help = true;
@@ -1976,6 +6152,30 @@ int main(int argc, const char** argv) {
                     if (out_directory.length() == 0) {
                         out_directory = ".";
                     }
+                    if (ONLY_PATTERNS.size() != 0 && remove_files) {
+                        fmt::print("--only cannot be used with -r, the splits hold entries that are not restored\n");
+                        return -1;
+                    }
+                    if (JOIN_UPDATE && remove_files) {
+                        fmt::print("--update cannot be used with -r, the splits hold entries that are not restored\n");
+                        return -1;
+                    }
+                    if (JOIN_DELETE && !JOIN_UPDATE) {
+                        fmt::print("--delete requires --update\n");
+                        return -1;
+                    }
+                    if (JOIN_DELETE && ONLY_PATTERNS.size() != 0) {
+                        fmt::print("--delete cannot be used with --only\n");
+                        return -1;
+                    }
+                    if (JOIN_RESUME && JOIN_SPLITS.length() != 0) {
+                        fmt::print("--resume cannot be used with --splits, the {{map}}.done journal already tracks them\n");
+                        return -1;
+                    }
+                    if (JOIN_RESUME || JOIN_SPLITS.length() != 0) {
+                        // what an interrupted or earlier join left behind is kept the way --update does
+                        JOIN_UPDATE = true;
+                    }
                     PathRecorder p;
                     return p.playback(file.c_str(), true, true);
                 }
@@ -1984,6 +6184,30 @@ int main(int argc, const char** argv) {
                     next_is_name = false;
                     continue;
                 }
+                if (next_is_threads) {
+                    int threads = atoi(argv[0]);
+                    if (threads < 0 || threads > 1024) {
+                        fmt::print("thread count must be between 0 and 1024: {}\n", argv[0]);
+                        return -1;
+                    }
+                    JOIN_THREADS = (unsigned)threads;
+                    next_is_threads = false;
+                    continue;
+                }
+                if (next_is_only) {
+                    ONLY_PATTERNS.emplace_back(argv[0]);
+                    next_is_only = false;
+                    continue;
+                }
+                if (next_is_splits) {
+                    JOIN_SPLITS = argv[0];
+                    if (JOIN_SPLITS.length() == 0) {
+                        fmt::print("--splits requires a list of splits\n");
+                        return -1;
+                    }
+                    next_is_splits = false;
+                    continue;
+                }
                 if (strcmp(argv[0], "-n") == 0) {
                     dry_run = true;
                     continue;
@@ -2000,6 +6224,30 @@ int main(int argc, const char** argv) {
                     next_is_name = true;
                     continue;
                 }
+                if (strcmp(argv[0], "--threads") == 0) {
+                    next_is_threads = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--only") == 0) {
+                    next_is_only = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--update") == 0) {
+                    JOIN_UPDATE = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--delete") == 0) {
+                    JOIN_DELETE = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--resume") == 0) {
+                    JOIN_RESUME = true;
+                    continue;
+                }
+                if (strcmp(argv[0], "--splits") == 0) {
+                    next_is_splits = true;
+                    continue;
+                }
                 // any other arg MIGHT be invalid, show help if explicitly requested
                 if (strcmp(argv[0], "-h") == 0 || strcmp(argv[0], "--help") == 0) {
                     next_is_help = true;
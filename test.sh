@@ -7,4 +7,94 @@
 	../split.exe --split -r ../build --name build || exit
 	../split.exe --join ./build.split.map --out ../build -r || exit
 )
+(
+	# --exclude patterns, check what --ls still lists
+	rm -rf glob glob.split*
+	mkdir -p glob/rebuild glob/build glob/my.git glob/.git glob/src glob/a/c || exit
+	for f in rebuild/x build/x my.git/x .git/x src/x README.md a/xb a/b a/c/b; do echo x > glob/$f; done
+	check() {
+		pattern="$1"
+		shift
+		rm -f glob.split*
+		./split.exe --split glob --name glob --exclude "$pattern" > /dev/null || exit
+		./split.exe --ls glob.split.map > glob.ls || exit
+		for item in "$@"; do
+			case "$item" in
+				-*) grep -q " ${item#-}\$" glob.ls && { echo "--exclude '$pattern' kept ${item#-}"; exit 1; } ;;
+				*) grep -q " $item\$" glob.ls || { echo "--exclude '$pattern' dropped $item"; exit 1; } ;;
+			esac
+		done
+	}
+	check build -build/x rebuild/x
+	check .git -.git/x my.git/x
+	check '[a-r]*' -a/b -build/x -my.git/x -rebuild/x src/x .git/x README.md
+	check 'a/**/b' -a/b -a/c/b a/xb
+	check '**/b' -a/b -a/c/b a/xb
+	check 'a/*b' -a/b -a/xb a/c/b
+	rm -rf glob glob.split* glob.ls
+)
+(
+	# --splits into a tree that holds a longer copy of a file
+	rm -rf splits splits_out splits.split*
+	mkdir -p splits splits_out || exit
+	head -c 300000 /dev/urandom > splits/f || exit
+	head -c 500000 /dev/urandom > splits_out/f || exit
+	./split.exe --split splits --name splits --size 65536 > /dev/null || exit
+	./split.exe --join splits.split.map --out splits_out --splits 0-1 > /dev/null || exit
+	./split.exe --join splits.split.map --out splits_out --splits present > /dev/null || exit
+	diff -r splits splits_out || { echo "--splits kept a stale tail"; exit 1; }
+	rm -rf splits splits_out splits.split*
+)
+(
+	# --update replaces a changed read-only file instead of writing through its links
+	rm -rf readonly readonly_out readonly.split* readonly_link
+	mkdir readonly || exit
+	echo one > readonly/f
+	chmod 444 readonly/f
+	./split.exe --split readonly --name readonly > /dev/null || exit
+	./split.exe --join readonly.split.map --out readonly_out > /dev/null || exit
+	ln readonly_out/f readonly_link || exit
+	chmod 644 readonly/f
+	echo two > readonly/f
+	chmod 444 readonly/f
+	rm -f readonly.split*
+	./split.exe --split readonly --name readonly > /dev/null || exit
+	./split.exe --join --update readonly.split.map --out readonly_out > /dev/null || exit
+	diff -r readonly readonly_out || { echo "--update did not refresh a read-only file"; exit 1; }
+	grep -q one readonly_link || { echo "--update wrote through a hard link"; exit 1; }
+	chmod -R u+w readonly readonly_out readonly_link
+	rm -rf readonly readonly_out readonly.split* readonly_link
+)
+(
+	# --update and --delete bring a joined tree up to date with a changed one
+	rm -rf join join_out join.split*
+	mkdir -p join/a/b join/c || exit
+	head -c 200000 /dev/urandom > join/a/big || exit
+	echo one > join/a/b/f
+	echo two > join/c/g
+	./split.exe --split join --name join --size 65536 > /dev/null || exit
+	./split.exe --join join.split.map --out join_out > /dev/null || exit
+	echo changed >> join/a/b/f
+	rm -rf join/c
+	echo new > join/new
+	echo stray > join_out/stray
+	rm -f join.split*
+	./split.exe --split join --name join --size 65536 > /dev/null || exit
+	./split.exe --join --update --delete join.split.map --out join_out > /dev/null || exit
+	diff -r join join_out || { echo "--update --delete did not match the tree"; exit 1; }
+
+	# --resume writes what a later file is missing
+	rm -f join_out/new
+	./split.exe --join --resume join.split.map --out join_out > /dev/null || exit
+	diff -r join join_out || { echo "--resume did not finish the tree"; exit 1; }
+
+	# --splits joins a range first and the rest as present
+	rm -rf join_out join.split.map.done
+	./split.exe --join --splits 0-1 join.split.map --out join_out > /dev/null || exit
+	test -f join.split.map.done || { echo "--splits did not write its journal"; exit 1; }
+	./split.exe --join --splits present join.split.map --out join_out > /dev/null || exit
+	test -f join.split.map.done && { echo "--splits kept its journal after every split"; exit 1; }
+	diff -r join join_out || { echo "--splits did not match the tree"; exit 1; }
+	rm -rf join join_out join.split*
+)
 rm ../split.exe
\ No newline at end of file